@@ -83,6 +83,11 @@ void adc_init (void)
     ui16_adc_torque_sensor_offset += UI16_ADC_10_BIT_TORQUE_SENSOR;
   }
   ui16_g_adc_torque_sensor_min_value = ui16_adc_torque_sensor_offset >> 4;
+
+  // arm the analog watchdog on the battery current channel, the PWM interrupt checks it after each current conversion
+  ADC1_SetHighThreshold(ui16_g_adc_current_offset + ADC_CURRENT_CUTOFF);
+  ADC1_SetLowThreshold(0);
+  ADC1_AWDChannelConfig(ADC1_CHANNEL_5, ENABLE);
 }
 
 static void adc_trigger (void)
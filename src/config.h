@@ -16,19 +16,41 @@
 // The limit of max battery current on original firmware is 16 amps!!
 #define ADC_BATTERY_CURRENT_MAX 128 // 20 amps (0.156 amps each unit) - note that on original firmware is 16 amps
 #define ADC_MOTOR_CURRENT_MAX 192 // 30 amps (0.156 amps each unit)
+// Hardware overcurrent cutoff: the PWM is disabled when the current ADC value is over this value (over ADC_MOTOR_CURRENT_MAX)
+#define ADC_CURRENT_CUTOFF 256 // 40 amps (0.156 amps each unit)
 
 // *************************************************************************** //
 // MOTOR CONTROLLER
 
+// Choose the PWM frequency: TIM1 counts up and down between 0 and PWM_COUNTER_MAX, PWM frequency = 16MHz / (2 * PWM_COUNTER_MAX)
+// and every PWM cycles time base of the firmware is derived from this value.
+// 420 = 19.05kHz; valid values are 420 up to 510 (15.7kHz, max of the 9 bits duty_cycle).
+// The PWM interrupt was measured only at 420 (42us of the 52.5us period), so a higher PWM frequency (lower value) may not
+// fit the interrupt code. A lower PWM frequency has lower MOSFETs switching losses and more time for the main loop.
+#define PWM_COUNTER_MAX 420
+
 // Choose PWM ramp up/down step (higher value will make the motor acceleration slower)
 //
 // For a 24V battery, 25 for ramp up seems ok. For an higher voltage battery, this values should be higher
-#define PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP 44
-#define PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP 34
+// (values for the 8 bits duty_cycle, the 9 bits duty_cycle steps are half of it)
+#define PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP 22
+#define PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP 17
+
+// Brake (brake sensor or coaster brake): 1 to cut the motor on the next PWM cycle and disable the PWM outputs until the
+// brake is released, 0 to ramp down the duty_cycle
+#define BRAKE_FAST_CUTOFF 1
 
-// The following value were tested by Casainho on 2020.04.23 
-#define FIELD_WEAKENING_RAMP_UP_INVERSE_STEP 600
-#define FIELD_WEAKENING_RAMP_DOWN_INVERSE_STEP 600
+// PWM cycles for each field weakening angle step to the target: 1 ms
+#define FIELD_WEAKENING_INVERSE_STEP ((uint16_t) (PWM_CYCLES_SECOND / 1000))
+// field weakening angle steps (1 ms each) for each increase over the target, while the motor voltage is saturated: 8 ms
+#define FIELD_WEAKENING_RAMP_UP_INVERSE_STEP 8
+
+// Torque sensor: the torque sensor signal has the ripple of its excitation pulse (TIM2, 20us period with a 2us pulse).
+// Only the ADC samples that start at this phase of the excitation are used: TIM2 counter value from 0 to 140 (the counter
+// counts from 0 to 159 and the pulse is from 0 to 16), at the start of the ADC scan conversion.
+// The samples phase moves by PWM_COUNTER_MAX TIM2 counts each PWM cycle, so a PWM_COUNTER_MAX that is a multiple of 32 or 40
+// may never sample this phase: the torque sensor is then read without the synchronization.
+#define TORQUE_SENSOR_EXCITATION_PHASE 120
 
 // *************************************************************************** //
 // MOTOR
@@ -43,4 +65,24 @@
 // interpolation 60 degrees and must be found experimentally but a value of 25 may be good
 #define MOTOR_ROTOR_ERPS_START_INTERPOLATION_60_DEGREES 10
 
+// Motor thermal model, to limit the motor current when there is no motor temperature sensor: 1 to enable, 0 to disable.
+// The winding and the case temperatures are estimated from the motor losses and the motor current is reduced from
+// MOTOR_THERMAL_TEMPERATURE_MIN_TO_LIMIT to 0 at MOTOR_THERMAL_TEMPERATURE_MAX_TO_LIMIT of the winding temperature.
+// The model starts at the ambient temperature, so it does not know about a motor that is still hot at power on.
+// Disabled by default: the following coefficients are estimates, not fitted to measured motor temperatures. Fit them
+// to your motor before enabling it, or the current may be reduced at normal sustained currents.
+#define MOTOR_THERMAL_MODEL 0
+#define MOTOR_THERMAL_AMBIENT_TEMPERATURE 25 // degrees C
+#define MOTOR_THERMAL_TEMPERATURE_MIN_TO_LIMIT 110 // degrees C
+#define MOTOR_THERMAL_TEMPERATURE_MAX_TO_LIMIT 130 // degrees C
+// copper losses = motor current ^ 2 * resistance; iron losses increase with the motor speed
+#define MOTOR_THERMAL_RESISTANCE_MILLIOHMS 150
+#define MOTOR_THERMAL_IRON_LOSSES_MILLIWATTS_PER_ERPS 50
+// heat capacity of the winding (with the stator) and of the case, J per degree C
+#define MOTOR_THERMAL_WINDING_CAPACITY 150
+#define MOTOR_THERMAL_CASE_CAPACITY 600
+// thermal resistance from the winding to the case and from the case to the ambient, degrees C per W x100
+#define MOTOR_THERMAL_WINDING_CASE_RESISTANCE_X100 50
+#define MOTOR_THERMAL_CASE_AMBIENT_RESISTANCE_X100 100
+
 #endif /* _CONFIG_H_ */
@@ -9,7 +9,6 @@
 #include "ebike_app.h"
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>
 #include "stm8s.h"
 #include "stm8s_gpio.h"
 #include "main.h"
@@ -23,6 +22,7 @@
 #include "config.h"
 #include "utils.h"
 #include "lights.h"
+#include "eeprom.h"
 
 #define STATE_NO_PEDALLING                0
 #define STATE_PEDALLING                   2
@@ -48,6 +48,9 @@ volatile struct_config_vars m_config_vars;
 #define ERROR_NO_SPEED_SENSOR_DETECTED          (1 << 6)
 #define ERROR_FATAL                             (1 << 7)
 
+// motor keeps running with the BEMF observer, so this is only reported and not part of ui8_m_system_state
+#define WARNING_HALL_SENSORS_FAULT              (1 << 0)
+
 // Motor init state
 #define MOTOR_INIT_STATE_RESET                  0
 #define MOTOR_INIT_STATE_NO_INIT                1
@@ -80,6 +83,11 @@ uint8_t ui8_m_torque_sensor_startup_threshold_ok;
 uint8_t ui8_m_pedal_human_power = 0;
 uint8_t ui8_pas_pedal_position_right = 0;
 uint16_t ui16_m_adc_motor_temperatured_accumulated = 0;
+
+// motor thermal model: heat of the winding and of the case over the ambient temperature, in mJ
+static int32_t i32_m_motor_winding_heat = 0;
+static int32_t i32_m_motor_case_heat = 0;
+static uint16_t ui16_m_motor_winding_temperature_x2 = MOTOR_THERMAL_AMBIENT_TEMPERATURE << 1;
 uint16_t ui16_m_adc_target_current;
 uint8_t ui8_tstr_state_machine = STATE_NO_PEDALLING;
 static volatile uint8_t ui8_m_motor_enabled = 0;
@@ -123,19 +131,42 @@ static uint16_t     ui16_wheel_speed_x10;
 volatile uint32_t   ui32_wheel_speed_sensor_tick_counter = 0;
 
 // UART
-#define UART_RECEIVE_RINGBUFFER_SIZE   256 // Maximum size - can reduce later
+#define UART_RECEIVE_RINGBUFFER_SIZE   128 // must be a power of 2 and hold more than one full received package
+#define UART_RECEIVE_RINGBUFFER_MASK   (UART_RECEIVE_RINGBUFFER_SIZE - 1)
 volatile uint8_t ui8_rx_ringbuffer[UART_RECEIVE_RINGBUFFER_SIZE];
 volatile uint8_t ui8_rx_ringbuffer_read_index = 0;
 volatile uint8_t ui8_rx_ringbuffer_write_index = 0;
 
-#define UART_NUMBER_DATA_BYTES_TO_RECEIVE   256//88
-#define UART_NUMBER_DATA_BYTES_TO_SEND      256//29
+#define UART_NUMBER_DATA_BYTES_TO_RECEIVE   87 // configurations package: 85 bytes + 2 CRC bytes
+#define UART_NUMBER_DATA_BYTES_TO_SEND      36 // periodic package: 34 bytes + 2 CRC bytes
+#define UART_FRAME_BUFFER_SIZE              UART_NUMBER_DATA_BYTES_TO_RECEIVE
+
+#if UART_NUMBER_DATA_BYTES_TO_SEND > UART_FRAME_BUFFER_SIZE
+#error "UART_NUMBER_DATA_BYTES_TO_SEND must fit on the UART frame buffer"
+#endif
+
+/*---------------------------------------------------------
+  NOTE: regarding UART frame buffer
+
+  There is only one frame buffer, for both received and
+  sent packages. The received package is assembled on it,
+  processed in place and then the answer package is built
+  over it, so on communications_process_packages() all the
+  received bytes must be read before writing the answer
+  bytes with the same index.
+
+  The packet_assembler() will not touch the frame buffer
+  while the answer package is still being sent. The packages
+  sent without a received one (ALIVE) are only built when the
+  packet_assembler() is not in the middle of a package.
+---------------------------------------------------------*/
+volatile uint8_t ui8_uart_frame_buffer[UART_FRAME_BUFFER_SIZE];
+#define ui8_rx_buffer                       ui8_uart_frame_buffer
+#define ui8_tx_buffer                       ui8_uart_frame_buffer
 
 volatile uint8_t ui8_received_package_flag = 0;
-volatile uint8_t ui8_rx_buffer[UART_NUMBER_DATA_BYTES_TO_RECEIVE];
 volatile uint8_t ui8_rx_cnt = 0;
 volatile uint8_t ui8_rx_len = 0;
-volatile uint8_t ui8_tx_buffer[UART_NUMBER_DATA_BYTES_TO_SEND];
 static volatile uint8_t ui8_m_tx_buffer_index;
 volatile uint8_t ui8_i;
 volatile uint8_t ui8_byte_received;
@@ -156,13 +187,16 @@ static void ebike_app_set_target_adc_battery_max_current(uint16_t ui16_value);
 static void ebike_app_set_target_adc_motor_max_current(uint16_t ui16_value);
 
 static void check_system(void);
+static void save_battery_totals(void);
 static void throttle_read(void);
 static void read_pas_cadence(void);
 static void torque_sensor_read(void);
 static void linearize_torque_sensor_to_kgs(uint16_t *ui16_p_torque_sensor_adc_steps, uint16_t *ui16_torque_sensor_weight, uint8_t *ui8_p_pas_pedal_right);
+static void calc_torque_sensor_linearize_intervals(void);
 static void calc_pedal_force_and_torque(void);
 static void calc_wheel_speed(void);
 static void calc_motor_temperature(void);
+static void calc_motor_thermal_model(void);
 static uint16_t calc_filtered_battery_voltage(void);
 
 static void apply_speed_limit(uint16_t ui16_speed_x10, uint8_t ui8_max_speed, uint16_t *ui16_target_current);
@@ -171,6 +205,20 @@ static void apply_walk_assist(uint16_t *ui16_p_adc_target_current);
 static void apply_cruise(uint16_t *ui16_target_current);
 static void apply_throttle(uint16_t *ui16_target_current, uint8_t ui8_assist_enable);
 
+// parameters derived from the configuration, update_derived_parameters() calculates them again only when it changes:
+// the assist level factor (x1000) and the boost assist level (x100) times the conversion of the pedal power x10 to ADC
+// current steps (0.156A each), as Q24 multipliers, and the pedal power x10 over which the current is the motor max current
+static uint16_t ui16_m_derived_assist_level_factor_x1000 = 0;
+static uint16_t ui16_m_derived_boost_assist_level = 0;
+static uint16_t ui16_m_derived_adc_motor_current_max = 0;
+static uint32_t ui32_m_assist_level_factor_q24 = 0;
+static uint32_t ui32_m_assist_power_x10_max = 0xffffffff;
+static uint32_t ui32_m_boost_assist_level_q24 = 0;
+static uint32_t ui32_m_boost_power_x10_max = 0xffffffff;
+static void update_derived_parameters(void);
+static uint32_t calc_assist_power_x10_max(uint32_t ui32_factor_q24);
+static uint16_t calc_assist_adc_current(uint32_t ui32_power_x10, uint32_t ui32_factor_q24, uint32_t ui32_power_x10_max);
+
 
 // BOOST
 uint8_t   ui8_startup_boost_enable = 0;
@@ -186,8 +234,12 @@ static uint8_t apply_boost(uint8_t ui8_pas_cadence, uint16_t ui16_max_current_bo
 static void apply_boost_fade_out(uint16_t *ui16_adc_target_current);
 
 #define TORQUE_SENSOR_LINEARIZE_NR_POINTS 8
+#define TS_ADC_VALUE           0
+#define TS_ADC_INTERVAL_STEPS  1
 uint16_t ui16_torque_sensor_linearize_right[TORQUE_SENSOR_LINEARIZE_NR_POINTS][2];
 uint16_t ui16_torque_sensor_linearize_left[TORQUE_SENSOR_LINEARIZE_NR_POINTS][2];
+static uint16_t ui16_m_torque_sensor_linearize_start[2]; // left, right
+static uint32_t ui32_m_torque_sensor_linearize_weight[2][TORQUE_SENSOR_LINEARIZE_NR_POINTS];
 
 static uint8_t m_ui8_got_configurations_timer = 0;
 
@@ -205,17 +257,73 @@ void ebike_app_controller(void)
   calc_pedal_force_and_torque();
   calc_wheel_speed();
   calc_motor_temperature();
+  calc_motor_thermal_model();
   ebike_control_motor();
   packet_assembler();
   communications_controller();
   check_system();
+  save_battery_totals();
+}
+
+static void update_derived_parameters(void)
+{
+  if ((ui16_m_derived_assist_level_factor_x1000 == m_config_vars.ui16_assist_level_factor_x1000) &&
+      (ui16_m_derived_boost_assist_level == m_config_vars.ui16_startup_motor_power_boost_assist_level) &&
+      (ui16_m_derived_adc_motor_current_max == ui16_m_adc_motor_current_max))
+    return;
+
+  ui16_m_derived_assist_level_factor_x1000 = m_config_vars.ui16_assist_level_factor_x1000;
+  ui16_m_derived_boost_assist_level = m_config_vars.ui16_startup_motor_power_boost_assist_level;
+  ui16_m_derived_adc_motor_current_max = ui16_m_adc_motor_current_max;
+
+  // current = (power_x10 * assist_level_factor_x1000 / 1000) * 51 / 80
+  // 6.410 = 1 / 0.156 (each ADC step for current)
+  // 6.410 * 8 = ~51
+  // 51 * 2^24 / 80000 = 10695 + 297 / 625, rounded. Q24 and not Q16: the Q16 rounding error of small factors adds up
+  // to 2 ADC steps over the range
+  ui32_m_assist_level_factor_q24 = (((uint32_t) ui16_m_derived_assist_level_factor_x1000) * 10695) +
+                                   (((((uint32_t) ui16_m_derived_assist_level_factor_x1000) * 297) + 312) / 625);
+  // same for boost, that is x100: 51 * 2^24 / 8000 = 106954 + 94 / 125. Over 40000 it does not fit 32 bits, and any
+  // pedal power gives over the motor max current (ADC_MOTOR_CURRENT_MAX is up to 255)
+  if (ui16_m_derived_boost_assist_level > 40000)
+    ui32_m_boost_assist_level_q24 = 0xffffffff;
+  else
+    ui32_m_boost_assist_level_q24 = (((uint32_t) ui16_m_derived_boost_assist_level) * 106954) +
+                                    (((((uint32_t) ui16_m_derived_boost_assist_level) * 94) + 62) / 125);
+
+  // over these values the current is limited to the motor max current, and the Q24 multiplication does not overflow
+  // (under them, power_x10 * multiplier < motor max current << 24)
+  ui32_m_assist_power_x10_max = 0xffffffff;
+  if (ui32_m_assist_level_factor_q24)
+    ui32_m_assist_power_x10_max = calc_assist_power_x10_max(ui32_m_assist_level_factor_q24);
+
+  ui32_m_boost_power_x10_max = 0xffffffff;
+  if (ui32_m_boost_assist_level_q24)
+    ui32_m_boost_power_x10_max = calc_assist_power_x10_max(ui32_m_boost_assist_level_q24);
+}
+
+// the min pedal power x10 with the current at the motor max current: (motor max current << 24) / multiplier, rounded up
+static uint32_t calc_assist_power_x10_max(uint32_t ui32_factor_q24)
+{
+  if (ui16_m_derived_adc_motor_current_max == 0)
+    return 0;
+
+  return (((((uint32_t) ui16_m_derived_adc_motor_current_max) << 24) - 1) / ui32_factor_q24) + 1;
+}
+
+static uint16_t calc_assist_adc_current(uint32_t ui32_power_x10, uint32_t ui32_factor_q24, uint32_t ui32_power_x10_max)
+{
+  if (ui32_power_x10 >= ui32_power_x10_max)
+    return ui16_m_adc_motor_current_max;
+  else
+    return (uint16_t) ((ui32_power_x10 * ui32_factor_q24) >> 24);
 }
 
 static void ebike_control_motor(void)
 {
   uint32_t ui32_temp = 0;
   uint32_t ui32_pedal_power_no_cadence_x10 = 0;
-  uint32_t ui32_assist_level_factor_x1000;
+  uint32_t ui32_assist_power_x10;
   uint8_t ui8_tmp_pas_cadence_rpm;
   uint16_t ui16_adc_current;
   uint16_t ui16_adc_max_battery_power_current = 0;
@@ -224,9 +332,8 @@ static void ebike_control_motor(void)
   uint16_t ui16_battery_voltage_filtered = calc_filtered_battery_voltage();
   uint16_t ui16_adc_battery_current_max = 0;
   uint8_t ui8_assist_enable = 0;
-  uint32_t ui32_current_amps_x10_final;
-  uint32_t ui32_current_amps_x10;
-  uint32_t ui32_current_amps_fixed_cadence_x10;
+
+  update_derived_parameters();
 
   // the ui8_m_brake_is_set is updated here only and used all over ebike_control_motor()
   ui8_g_brake_is_set = ui8_g_brakes_state;
@@ -235,51 +342,46 @@ static void ebike_control_motor(void)
   ui16_m_adc_target_current = 0;
 
   // controller works with no less than 15V so calculate the target current only for higher voltages
-  if (ui16_battery_voltage_filtered > 15)
+  if (ui16_battery_voltage_filtered > (15 << 4))
   {
     if (m_config_vars.ui16_assist_level_factor_x1000 > 0)
     {
       ui8_assist_enable = 1;
 
-      // calc regular assist level
-      ui32_assist_level_factor_x1000 = (uint32_t) m_config_vars.ui16_assist_level_factor_x1000;
-
       // current mode
       if (m_config_vars.ui8_motor_current_control_mode)
       {
-        ui32_current_amps_fixed_cadence_x10 = ((uint32_t) ui16_m_pedal_power_fixed_cadence_x10 * ui32_assist_level_factor_x1000) / 1000;
-
-        ui32_current_amps_x10_final = ui32_current_amps_fixed_cadence_x10;
+        ui32_assist_power_x10 = ui16_m_pedal_power_fixed_cadence_x10;
 
         // conditions for reseting the current value
         if ((ui8_m_torque_sensor_startup_threshold_ok == 0) || // not enough torque
             (ui8_pas_cadence_rpm == 0)) // no cadence
         {
-          ui32_current_amps_x10_final = 0;
+          ui32_assist_power_x10 = 0;
         }
 
         // if startup_without_pedal_rotation, then set current if there is enough torque
         if ((m_config_vars.ui8_motor_assistance_startup_without_pedal_rotation) &&
             ui8_m_torque_sensor_startup_threshold_ok)
         {
-          ui32_current_amps_x10_final = ui32_current_amps_fixed_cadence_x10;
+          ui32_assist_power_x10 = ui16_m_pedal_power_fixed_cadence_x10;
         }
       }
       else // power mode
       {
         if (ui8_pas_cadence_rpm) // if cadence
         {
-          ui32_current_amps_x10_final = ((uint32_t) ui16_m_pedal_power_x10 * ui32_assist_level_factor_x1000) / 1000;;
+          ui32_assist_power_x10 = ui16_m_pedal_power_x10;
         }
         else
         {
-          ui32_current_amps_x10_final = 0;
+          ui32_assist_power_x10 = 0;
         }
 
         // conditions for reseting the current value
         if (ui8_m_torque_sensor_startup_threshold_ok == 0) // not enough torque
         {
-          ui32_current_amps_x10_final = 0;
+          ui32_assist_power_x10 = 0;
         }
 
         // if startup_without_pedal_rotation, then set current if there is enough torque
@@ -289,14 +391,12 @@ static void ebike_control_motor(void)
           // assist level used for when startup_without_pedal_rotation (force a min of 10 RPM cadence)
           ui32_pedal_power_no_cadence_x10 = (((uint32_t) ui16_m_pedal_torque_x100 * 10) / (uint32_t) 96);
 
-          ui32_current_amps_x10_final = (ui32_pedal_power_no_cadence_x10 * ui32_assist_level_factor_x1000) / 1000;
+          ui32_assist_power_x10 = ui32_pedal_power_no_cadence_x10;
         }
       }
 
-      // 6.410 = 1 / 0.156 (each ADC step for current)
-      // 6.410 * 8 = ~51
-      ui16_adc_current = (uint16_t) ((ui32_current_amps_x10_final * 51) / 80);
-      ui16_limit_max(&ui16_adc_current, ui16_m_adc_motor_current_max);
+      // assist level factor and conversion to ADC current steps
+      ui16_adc_current = calc_assist_adc_current(ui32_assist_power_x10, ui32_m_assist_level_factor_q24, ui32_m_assist_power_x10_max);
 
       // if user is rotating the pedals, force use the min current value
       if (ui8_pas_cadence_rpm &&
@@ -310,12 +410,7 @@ static void ebike_control_motor(void)
       // now calculate the current for BOOST
       if (m_config_vars.ui16_startup_motor_power_boost_assist_level > 0)
       {
-        ui32_current_amps_x10 = (ui32_pedal_power_no_cadence_x10 * (uint32_t) m_config_vars.ui16_startup_motor_power_boost_assist_level) / 100;
-
-        // 6.410 = 1 / 0.156 (each ADC step for current)
-        // 6.410 * 8 = ~51
-        ui16_adc_current = (uint16_t) ((ui32_current_amps_x10 * 51) / 80);
-        ui16_limit_max(&ui16_adc_current, ui16_m_adc_motor_current_max);
+        ui16_adc_current = calc_assist_adc_current(ui32_pedal_power_no_cadence_x10, ui32_m_boost_assist_level_q24, ui32_m_boost_power_x10_max);
 
         // if user is rotating the pedals, force use the min current value
         if (ui8_pas_cadence_rpm &&
@@ -329,8 +424,8 @@ static void ebike_control_motor(void)
 
       // 160 is the factor to convert from AMPS_DIV25 to ADC steps
       // 6.410 = 1 / 0.156 (each ADC step for current)
-      // 6.410 * 25 = 160
-      ui16_adc_max_battery_power_current = (((uint32_t) m_config_vars.ui8_target_battery_max_power_div25) * 160) / ((uint32_t) ui16_battery_voltage_filtered);
+      // 6.410 * 25 = 160, * 16 for the voltage x16
+      ui16_adc_max_battery_power_current = (((uint32_t) m_config_vars.ui8_target_battery_max_power_div25) * (160 << 4)) / ((uint32_t) ui16_battery_voltage_filtered);
 
       // if user is rotating the pedals, force use the min current value
       if (ui8_pas_cadence_rpm &&
@@ -404,6 +499,9 @@ static void ebike_control_motor(void)
     ui16_limit_max(&ui16_adc_battery_current_max, ui16_adc_max_battery_power_current);
   }
 
+  // keep the loaded battery voltage over the cut off voltage, the battery resistance voltage sag increases with current
+  ui16_limit_max(&ui16_adc_battery_current_max, motor_get_adc_battery_current_max_cut_off());
+
   // motor over temperature protection
   apply_temperature_limiting(&ui16_m_adc_target_current);
 
@@ -434,14 +532,37 @@ static void ebike_control_motor(void)
     ui16_m_adc_target_current = 0;
   }
 
+  // the PWM interrupt disabled the motor because of overcurrent: keep it disabled until it stops, then it can be enabled again
+  if (ui8_g_overcurrent_fault)
+  {
+    ui8_m_motor_enabled = 0;
+
+    if (ui16_motor_get_motor_speed_erps() == 0)
+    {
+      ui8_g_overcurrent_fault = 0;
+    }
+  }
+
+  // the PWM interrupt disabled PWM outputs on brake: enable them again after brake release.
+  // Clear the flag after enable, so the interrupt disables them again if the brake is set in between
+  if (ui8_g_brake_cutoff && (ui8_g_brake_is_set == 0))
+  {
+    // if the motor is spinning and can not be enabled now, enable it on the next check after it stops
+    if (ui8_m_motor_enabled && (motor_enable_pwm_flying_start() == 0))
+      ui8_m_motor_enabled = 0;
+
+    ui8_g_brake_cutoff = 0;
+  }
+
   // check to see if we should enable the motor
   if(ui8_m_motor_enabled == 0 &&
-    (ui16_motor_get_motor_speed_erps() == 0) && // we can only enable if motor is stopped other way something bad can happen due to high currents/regen or something like that
+     ui8_g_overcurrent_fault == 0 &&
      ui16_m_adc_target_current)
   {
-    ui8_m_motor_enabled = 1;
-    ui8_g_duty_cycle = 0;
-    motor_enable_pwm();
+    // on a spinning motor, a duty_cycle of 0 would give high regen currents, so the duty_cycle starts at the motor BEMF.
+    // If the motor BEMF is not yet known, we can only enable if motor is stopped
+    if (motor_enable_pwm_flying_start())
+      ui8_m_motor_enabled = 1;
   }
 
   // check to see if we should disable the motor
@@ -449,7 +570,7 @@ static void ebike_control_motor(void)
       (ui8_m_motor_enabled &&
       ui16_motor_get_motor_speed_erps() == 0 &&
       ui16_m_adc_target_current == 0 &&
-      ui8_g_duty_cycle == 0))
+      ui16_g_duty_cycle == 0))
   {
     ui8_m_motor_enabled = 0;
     motor_disable_pwm();
@@ -465,7 +586,8 @@ static void ebike_control_motor(void)
   {
     ebike_app_set_target_adc_motor_max_current(0);
     ebike_app_set_target_adc_battery_max_current(0);
-    ui8_g_duty_cycle = 0;
+    ui16_g_duty_cycle = 0;
+    ui8_g_overmodulation = 0;
   }
 
   // set motor PWM target
@@ -535,7 +657,11 @@ static void communications_controller(void)
     ui8_m_system_state |= ERROR_FATAL;
   }
 
-  if (ui8_m_motor_init_state == MOTOR_INIT_STATE_RESET)
+  // the frame buffer is shared: do not overwrite a package being received, processed or sent
+  if ((ui8_m_motor_init_state == MOTOR_INIT_STATE_RESET) &&
+      (ui8_state_machine == 0) &&
+      (ui8_received_package_flag == 0) &&
+      (ui8_m_tx_buffer_index >= ui8_packet_len))
     communications_process_packages(COMM_FRAME_TYPE_ALIVE);
 }
 
@@ -595,8 +721,8 @@ static void communications_process_packages(uint8_t ui8_frame_type)
       // battery current
       // ADC 10 bits each step current is 0.156
       // 0.156 * 5 = 0.78
-      // send battery_current_x5
-      ui8_tx_buffer[5] = (uint8_t) ((ui16_g_adc_battery_current_filtered * 78) / 100);
+      // send battery_current_x5, from the current x8
+      ui8_tx_buffer[5] = (uint8_t) ((((uint32_t) ui16_g_adc_battery_current_filtered_x8) * 78) / 800);
 
       // wheel speed
       ui8_tx_buffer[6] = (uint8_t) (ui16_wheel_speed_x10 & 0xff);
@@ -643,9 +769,10 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 
       // PWM duty_cycle
       // convert duty-cycle to 0 - 100 %
-      // add field_weakening_angle
-      ui16_temp = (uint16_t) ui8_g_duty_cycle;
+      // add overmodulation (up to 10 %) and field_weakening_angle
+      ui16_temp = ui16_g_duty_cycle;
       ui16_temp = (ui16_temp * 100) / PWM_DUTY_CYCLE_MAX;
+      ui16_temp += (((uint16_t) ui8_g_overmodulation) * 10) / OVERMODULATION_MAX;
       if (ui8_g_field_weakening_enable_state)
       {
         ui16_temp += (((uint16_t) ui8_g_field_weakening_angle) * 14) / 10;
@@ -662,6 +789,8 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 
       // system state
       ui8_tx_buffer[19] = ui8_m_system_state;
+      if (ui8_g_hall_sensors_fault)
+        ui8_tx_buffer[19] |= WARNING_HALL_SENSORS_FAULT;
 
       // motor current
       // ADC 10 bits each step current is 0.156
@@ -681,7 +810,18 @@ static void communications_process_packages(uint8_t ui8_frame_type)
       // first 8 bits of adc_motor_current
       ui8_tx_buffer[26] = (uint8_t) (ui16_adc_battery_current & 0xff);
 
-      ui8_len += 24;
+      // hardware overcurrent cutoffs since power on
+      ui8_tx_buffer[27] = ui8_g_overcurrent_fault_counter;
+
+      // battery totals counted on the motor controller, 24 bits each: charge in mAh and energy in Wh x10
+      ui8_tx_buffer[28] = (uint8_t) (ui32_g_battery_charge_mah & 0xff);
+      ui8_tx_buffer[29] = (uint8_t) ((ui32_g_battery_charge_mah >> 8) & 0xff);
+      ui8_tx_buffer[30] = (uint8_t) ((ui32_g_battery_charge_mah >> 16) & 0xff);
+      ui8_tx_buffer[31] = (uint8_t) (ui32_g_battery_energy_wh_x10 & 0xff);
+      ui8_tx_buffer[32] = (uint8_t) ((ui32_g_battery_energy_wh_x10 >> 8) & 0xff);
+      ui8_tx_buffer[33] = (uint8_t) ((ui32_g_battery_energy_wh_x10 >> 16) & 0xff);
+
+      ui8_len += 31;
       break;
 
     // set configurations
@@ -740,26 +880,29 @@ static void communications_process_packages(uint8_t ui8_frame_type)
       }
 
       // calculate current step for ramp up
-      ui32_temp = ((uint32_t) 24375) / ((uint32_t) m_config_vars.ui8_ramp_up_amps_per_second_x10); // see note below
+      ui32_temp = ((uint32_t) CURRENT_RAMP_UP_INVERSE_STEP_X10) / ((uint32_t) m_config_vars.ui8_ramp_up_amps_per_second_x10); // see note below
       ui16_g_current_ramp_up_inverse_step = (uint16_t) ui32_temp;
 
       /*---------------------------------------------------------
       NOTE: regarding ramp up
 
-      Example of calculation:
-
-      Target ramp up: 5 amps per second
+      Every second has PWM_CYCLES_SECOND PWM cycles interrupts
+      and one ADC battery current step is 0.156 amps
+      (ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512 / 512).
 
-      Every second has 15625 PWM cycles interrupts,
-      one ADC battery current step --> 0.156 amps:
+      For a target ramp up of ramp_up_amps_per_second:
 
-      5 / 0.156 = 32 (we need to do 32 steps ramp up per second)
+      steps per second = ramp_up_amps_per_second / 0.156
 
-      Therefore:
+      PWM cycles per step = PWM_CYCLES_SECOND / steps per second
+                          = (PWM_CYCLES_SECOND * 0.156) / ramp_up_amps_per_second
 
-      15625 / 32 = 488
+      CURRENT_RAMP_UP_INVERSE_STEP_X10 = PWM_CYCLES_SECOND * 0.156 * 10,
+      so it is divided by ramp_up_amps_per_second_x10.
 
-      15625 * 0.156 = 2437.5; 2437.5 * 10 = 24375
+      Example: 5 amps per second at PWM_COUNTER_MAX 420 (19047 PWM
+      cycles per second): 5 / 0.156 = 32 steps per second and
+      19047 / 32 = 595 PWM cycles per step.
       ---------------------------------------------------------*/
 
       // received target speed for cruise
@@ -781,6 +924,8 @@ static void communications_process_packages(uint8_t ui8_frame_type)
         ui16_torque_sensor_linearize_right[i][1] |= ((uint16_t) ui8_rx_buffer[j++]) << 8;
       }
 
+      calc_torque_sensor_linearize_intervals();
+
       // battery current min ADC
       m_config_vars.ui8_battery_current_min_adc = ui8_rx_buffer[79];
 
@@ -925,69 +1070,44 @@ static void ebike_app_set_motor_max_current(uint8_t ui8_value)
 
 static void linearize_torque_sensor_to_kgs(uint16_t *ui16_adc_steps, uint16_t *ui16_weight_x10, uint8_t *ui8_pedal_right)
 {
-#define TS_ADC_VALUE           0
-#define TS_ADC_INTERVAL_STEPS  1
-
-  uint16_t ui16_array_sum[TORQUE_SENSOR_LINEARIZE_NR_POINTS];
   uint8_t ui8_i;
+  uint8_t ui8_pedal = *ui8_pedal_right ? 1 : 0;
   uint16_t ui16_adc_absolute;
   uint16_t (*ui16_array_linear)[2];
-  uint32_t ui32_temp = 0;
-  uint16_t _ui16_adc_steps = *ui16_adc_steps;
-  uint8_t _ui8_pedal_right = *ui8_pedal_right;
-
-  memset(ui16_array_sum, 0, sizeof(ui16_array_sum));
-
-  if (_ui8_pedal_right)
-    ui16_array_linear = ui16_torque_sensor_linearize_right;
-  else
-    ui16_array_linear = ui16_torque_sensor_linearize_left;
+  uint32_t ui32_temp;
 
-  if (_ui16_adc_steps > 0)
+  if (*ui16_adc_steps > 0)
   {
-    ui16_adc_absolute = _ui16_adc_steps + ui16_g_adc_torque_sensor_min_value;
+    if (ui8_pedal)
+      ui16_array_linear = ui16_torque_sensor_linearize_right;
+    else
+      ui16_array_linear = ui16_torque_sensor_linearize_left;
+
+    ui16_adc_absolute = *ui16_adc_steps + ui16_g_adc_torque_sensor_min_value;
 
+    // the interval of the value is the first one with the next point over the value, or the last one
     for (ui8_i = 0; ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1); ui8_i++)
     {
-      // value is under interval max value
       if (ui16_adc_absolute < ui16_array_linear[ui8_i + 1][TS_ADC_VALUE])
-      {
-        // first
-        if (ui8_i == 0)
-        {
-          ui16_array_sum[ui8_i] = _ui16_adc_steps;
-        }
-        else
-        {
-          ui16_array_sum[ui8_i] = ui16_adc_absolute - ui16_array_linear[ui8_i][TS_ADC_VALUE];
-        }
-
-        // exit the for loop as this was the last interval
         break;
-      }
-      // current value is over current interval
-      else
-      {
-        ui16_array_sum[ui8_i] = ui16_array_linear[ui8_i + 1][TS_ADC_VALUE] - ui16_array_linear[ui8_i][TS_ADC_VALUE];
-      }
     }
 
-    // count values under min value of array linear
-    if (ui16_g_adc_torque_sensor_min_value < ui16_array_linear[0][TS_ADC_VALUE])
-      ui16_array_sum[0] += (ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value);
-
-    // count with the values over max value of array linear
-    if (ui16_adc_absolute > ui16_array_linear[7][TS_ADC_VALUE])
-      ui16_array_sum[7] = ui16_adc_absolute - ui16_array_linear[7][TS_ADC_VALUE];
-
-    // sum the total parcels
-    for (ui8_i = 0; ui8_i < TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1; ui8_i++)
+    // weight of the full intervals before, plus the part of this interval
+    ui32_temp = ui32_m_torque_sensor_linearize_weight[ui8_pedal][ui8_i];
+    if (ui8_i == 0)
+    {
+      ui32_temp += ((uint32_t) ((uint16_t) (ui16_adc_absolute - ui16_m_torque_sensor_linearize_start[ui8_pedal]))) *
+                   ui16_array_linear[1][TS_ADC_INTERVAL_STEPS];
+    }
+    else if (ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1))
     {
-      ui32_temp += ((uint32_t) ui16_array_sum[ui8_i] * (uint32_t) ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS]);
+      ui32_temp += ((uint32_t) ((uint16_t) (ui16_adc_absolute - ui16_array_linear[ui8_i][TS_ADC_VALUE]))) *
+                   ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS];
     }
 
-    // sum the last parcel
-    ui32_temp += ((uint32_t) ui16_array_sum[7] * (uint32_t) ui16_array_linear[7][TS_ADC_INTERVAL_STEPS]);
+    // count with the values over max value of array linear (also on a previous interval, if the points are not in order)
+    if (ui16_adc_absolute > ui16_array_linear[7][TS_ADC_VALUE])
+      ui32_temp += ((uint32_t) (ui16_adc_absolute - ui16_array_linear[7][TS_ADC_VALUE])) * ui16_array_linear[7][TS_ADC_INTERVAL_STEPS];
 
     *ui16_weight_x10 = (uint16_t) (ui32_temp / 10);
   }
@@ -998,6 +1118,47 @@ static void linearize_torque_sensor_to_kgs(uint16_t *ui16_adc_steps, uint16_t *u
   }
 }
 
+// weight at the start of each interval of the torque sensor calibration tables, calculated when the tables are received,
+// so linearize_torque_sensor_to_kgs() only calculates the part of the interval of the value
+static void calc_torque_sensor_linearize_intervals(void)
+{
+  uint8_t ui8_i;
+  uint8_t ui8_pedal;
+  uint16_t ui16_steps;
+  uint16_t (*ui16_array_linear)[2];
+  uint32_t ui32_temp;
+
+  for (ui8_pedal = 0; ui8_pedal < 2; ui8_pedal++)
+  {
+    if (ui8_pedal)
+      ui16_array_linear = ui16_torque_sensor_linearize_right;
+    else
+      ui16_array_linear = ui16_torque_sensor_linearize_left;
+
+    // the first interval starts at the ADC offset and the values under min value of array linear are counted on it
+    // (on the ADC steps of the value, from the offset, and once more from the offset to the first point)
+    ui16_m_torque_sensor_linearize_start[ui8_pedal] = ui16_g_adc_torque_sensor_min_value;
+    ui16_steps = ui16_array_linear[1][TS_ADC_VALUE] - ui16_array_linear[0][TS_ADC_VALUE];
+    if (ui16_g_adc_torque_sensor_min_value < ui16_array_linear[0][TS_ADC_VALUE])
+    {
+      ui16_m_torque_sensor_linearize_start[ui8_pedal] -= ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value;
+      ui16_steps += ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value;
+    }
+
+    ui32_temp = 0;
+    for (ui8_i = 0; ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1); ui8_i++)
+    {
+      ui32_m_torque_sensor_linearize_weight[ui8_pedal][ui8_i] = ui32_temp;
+
+      if (ui8_i > 0)
+        ui16_steps = ui16_array_linear[ui8_i + 1][TS_ADC_VALUE] - ui16_array_linear[ui8_i][TS_ADC_VALUE];
+
+      ui32_temp += ((uint32_t) ui16_steps) * ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS];
+    }
+    ui32_m_torque_sensor_linearize_weight[ui8_pedal][TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1] = ui32_temp;
+  }
+}
+
 static void calc_pedal_force_and_torque(void)
 {
   // calculate power on pedals
@@ -1095,15 +1256,52 @@ static void calc_motor_temperature(void)
 }
 
 
+static void calc_motor_thermal_model(void)
+{
+  uint16_t ui16_current = ui16_g_adc_motor_current_filtered;
+  uint32_t ui32_losses;
+  int32_t i32_winding_temperature_x100;
+  int32_t i32_case_temperature_x100;
+  int32_t i32_winding_case_heat;
+  int32_t i32_case_ambient_heat;
+
+  // temperatures over the ambient, from the heat of each part
+  i32_winding_temperature_x100 = i32_m_motor_winding_heat / (MOTOR_THERMAL_WINDING_CAPACITY * 10);
+  i32_case_temperature_x100 = i32_m_motor_case_heat / (MOTOR_THERMAL_CASE_CAPACITY * 10);
+
+  // motor losses in mW: copper losses, current ADC step is 0.156A and 0.156 ^ 2 = 25 / 1024, plus the iron losses
+  ui32_losses = ((((uint32_t) ui16_current) * ui16_current) * (MOTOR_THERMAL_RESISTANCE_MILLIOHMS * 25)) >> 10;
+  ui32_losses += ((uint32_t) ui16_motor_get_motor_speed_erps()) * MOTOR_THERMAL_IRON_LOSSES_MILLIWATTS_PER_ERPS;
+
+  // heat flows on each tick, in mJ: temperature difference / thermal resistance
+  i32_winding_case_heat = ((i32_winding_temperature_x100 - i32_case_temperature_x100) * (1000 / MOTOR_THERMAL_MODEL_TICKS_SECOND)) /
+                          MOTOR_THERMAL_WINDING_CASE_RESISTANCE_X100;
+  i32_case_ambient_heat = (i32_case_temperature_x100 * (1000 / MOTOR_THERMAL_MODEL_TICKS_SECOND)) /
+                          MOTOR_THERMAL_CASE_AMBIENT_RESISTANCE_X100;
+
+  i32_m_motor_winding_heat += ((int32_t) (ui32_losses / MOTOR_THERMAL_MODEL_TICKS_SECOND)) - i32_winding_case_heat;
+  i32_m_motor_case_heat += i32_winding_case_heat - i32_case_ambient_heat;
+  if (i32_m_motor_winding_heat < 0) { i32_m_motor_winding_heat = 0; }
+  if (i32_m_motor_case_heat < 0) { i32_m_motor_case_heat = 0; }
+
+  ui16_m_motor_winding_temperature_x2 = (MOTOR_THERMAL_AMBIENT_TEMPERATURE << 1) + (uint16_t) (i32_winding_temperature_x100 / 50);
+}
+
+
+// battery voltage x16
 static uint16_t calc_filtered_battery_voltage(void)
 {
-  uint16_t ui16_batt_voltage_filtered = (uint16_t) motor_get_adc_battery_voltage_filtered_10b() * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512;
-  return (ui16_batt_voltage_filtered >> 9);
+  uint32_t ui32_batt_voltage_filtered = ((uint32_t) motor_get_adc_battery_voltage_filtered_x8()) * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512;
+  return (uint16_t) (ui32_batt_voltage_filtered >> 8);
 }
 
 
 static void apply_speed_limit(uint16_t ui16_speed_x10, uint8_t ui8_max_speed, uint16_t *ui16_target_current)
 {
+  // under the speed limit range, map() returns the same target current
+  if ((ui16_speed_x10 + 20) < (((uint16_t) ui8_max_speed) * 10))
+    return;
+
   *ui16_target_current = (uint16_t) (map((uint32_t) ui16_speed_x10,
                                         (uint32_t) ((ui8_max_speed * 10) - 20),
                                         (uint32_t) ((ui8_max_speed * 10) + 20),
@@ -1129,11 +1327,9 @@ static void apply_throttle(uint16_t *ui16_target_current, uint8_t ui8_assist_ena
 
     if (ui8_throttle)
     {
-      uint16_t ui16_temp = (uint16_t) (map((uint32_t) ui8_throttle,
-                                         (uint32_t) 0,
-                                         (uint32_t) 255,
-                                         (uint32_t) 0,
-                                         (uint32_t) ui16_m_adc_motor_current_max));
+      // same as map() from 0 - 255 to 0 - motor max current, for a motor max current up to 255:
+      // (throttle * (max + 1)) / 256, on 16 bits
+      uint16_t ui16_temp = (((uint16_t) ui8_throttle) * (ui16_m_adc_motor_current_max + 1)) >> 8;
 
       // set target current
       *ui16_target_current = ui16_temp;
@@ -1152,9 +1348,9 @@ static void apply_temperature_limiting(uint16_t *ui16_target_current)
     {
       *ui16_target_current = 0;
     }
-    else
+    // reduce motor current if over temperature (under the min value, map() returns the same target current)
+    else if (m_config_vars.ui16_motor_temperature_x2 >= (((uint16_t) m_config_vars.ui8_motor_temperature_min_value_to_limit) << 1))
     {
-      // reduce motor current if over temperature
       *ui16_target_current = 
         (uint16_t) (map((uint32_t) m_config_vars.ui16_motor_temperature_x2,
                         (uint32_t) (((uint16_t) m_config_vars.ui8_motor_temperature_min_value_to_limit) << 1),
@@ -1163,6 +1359,18 @@ static void apply_temperature_limiting(uint16_t *ui16_target_current)
                         (uint32_t) 0));
     }
   }
+#if MOTOR_THERMAL_MODEL
+  else if (ui16_m_motor_winding_temperature_x2 >= (MOTOR_THERMAL_TEMPERATURE_MIN_TO_LIMIT << 1))
+  {
+    // no motor temperature sensor: use the winding temperature of the motor thermal model
+    *ui16_target_current =
+      (uint16_t) (map((uint32_t) ui16_m_motor_winding_temperature_x2,
+                      (uint32_t) (MOTOR_THERMAL_TEMPERATURE_MIN_TO_LIMIT << 1),
+                      (uint32_t) (MOTOR_THERMAL_TEMPERATURE_MAX_TO_LIMIT << 1),
+                      (uint32_t) *ui16_target_current,
+                      (uint32_t) 0));
+  }
+#endif
 }
 
 static void apply_walk_assist(uint16_t *ui16_p_adc_target_current)
@@ -1415,7 +1623,8 @@ static void torque_sensor_read(void)
 {
   uint16_t ui16_adc_torque_sensor;
 
-  ui16_m_adc_torque_sensor_raw = UI16_ADC_10_BIT_TORQUE_SENSOR;
+  // 12 bits average of the samples in phase with the excitation pulse, rounded to the 10 bits ADC steps of the calibration
+  ui16_m_adc_torque_sensor_raw = (motor_get_adc_torque_sensor_x4() + 2) >> 2;
 
   if ((ui16_m_torque_sensor_adc_steps >= m_config_vars.ui8_torque_sensor_adc_threshold) ||
       (ui8_pas_cadence_rpm > 30)) // should be no problem to use cadence value calculated on the previous cycle
@@ -1503,13 +1712,18 @@ static void throttle_read(void)
 // Read the input buffer and assemble data as a package and signal that we have a package to process (on main slow loop)
 static void packet_assembler(void)
 {
+  // the frame buffer is shared with the package being sent, wait for it to be fully sent
+  if (ui8_m_tx_buffer_index < ui8_packet_len)
+    return;
+
   if (((uint8_t)ui8_rx_ringbuffer_read_index)!=((uint8_t)ui8_rx_ringbuffer_write_index))
   {
     if (ui8_received_package_flag == 0) // only when package were previously processed
     {
-      while (((uint8_t)(ui8_rx_ringbuffer_read_index+0x1) != ((uint8_t)ui8_rx_ringbuffer_write_index)))
+      while (((uint8_t)((ui8_rx_ringbuffer_read_index + 1) & UART_RECEIVE_RINGBUFFER_MASK)) != ((uint8_t)ui8_rx_ringbuffer_write_index))
       {
-        ui8_byte_received = ui8_rx_ringbuffer[(uint8_t)(ui8_rx_ringbuffer_read_index++)];
+        ui8_byte_received = ui8_rx_ringbuffer[ui8_rx_ringbuffer_read_index];
+        ui8_rx_ringbuffer_read_index = (ui8_rx_ringbuffer_read_index + 1) & UART_RECEIVE_RINGBUFFER_MASK;
         
         switch (ui8_state_machine)
         {
@@ -1523,6 +1737,13 @@ static void packet_assembler(void)
           break;
 
           case 1:
+            // discard packages that would not fit on the frame buffer
+            if (((uint16_t) ui8_byte_received + 2) > UART_FRAME_BUFFER_SIZE)
+            {
+              ui8_state_machine = 0;
+              break;
+            }
+
             ui8_rx_buffer[1] = ui8_byte_received;
             ui8_rx_len = ui8_byte_received;
             ui8_state_machine = 2;
@@ -1564,10 +1785,12 @@ void UART2_RX_IRQHandler(void) __interrupt(UART2_RX_IRQHANDLER)
     UART2->SR &= (uint8_t)~(UART2_FLAG_RXNE); // this may be redundant
 
     //Write the recieved data to the ringbuffer at the write index position, move write index forward.
-    ui8_rx_ringbuffer[(uint8_t)(ui8_rx_ringbuffer_write_index++)] = ((uint8_t)UART2->DR);//UART2_ReceiveData8(); save a few cycles...
+    ui8_rx_ringbuffer[ui8_rx_ringbuffer_write_index] = ((uint8_t)UART2->DR);//UART2_ReceiveData8(); save a few cycles...
+    ui8_rx_ringbuffer_write_index = (ui8_rx_ringbuffer_write_index + 1) & UART_RECEIVE_RINGBUFFER_MASK;
 
     // If write index hits the read index - move read index forward. Effectively overwrites the oldest data in the buffer.
-    if (((uint8_t)ui8_rx_ringbuffer_write_index)==(uint8_t)(ui8_rx_ringbuffer_read_index)) ui8_rx_ringbuffer_read_index++;
+    if (((uint8_t)ui8_rx_ringbuffer_write_index)==(uint8_t)(ui8_rx_ringbuffer_read_index))
+      ui8_rx_ringbuffer_read_index = (ui8_rx_ringbuffer_read_index + 1) & UART_RECEIVE_RINGBUFFER_MASK;
   
   }
 }
@@ -1655,3 +1878,20 @@ void check_system()
     }
   }
 }
+
+static void save_battery_totals(void)
+{
+  static uint16_t ui16_save_counter = 0;
+
+  // save the battery totals to data EEPROM while the motor is disabled, as the CPU may stall on EEPROM writes
+  // and the battery is usually turned off with the motor stopped. At most once every BATTERY_TOTALS_SAVE_INTERVAL
+  if (ui16_save_counter < BATTERY_TOTALS_SAVE_INTERVAL)
+  {
+    ++ui16_save_counter;
+  }
+  else if (ui8_m_motor_enabled == 0)
+  {
+    ui16_save_counter = 0;
+    eeprom_write_battery_totals();
+  }
+}
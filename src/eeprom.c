@@ -0,0 +1,84 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware/
+ *
+ * Copyright (C) Casainho, 2018.
+ *
+ * Released under the GPL License, Version 3
+ */
+
+#include <stdint.h>
+#include "stm8s.h"
+#include "stm8s_flash.h"
+#include "eeprom.h"
+#include "motor.h"
+
+// battery totals on data EEPROM: charge, energy and a check word of both, so a write interrupted by a power off is not used
+#define ADDRESS_BATTERY_CHARGE_MAH        (FLASH_DATA_START_PHYSICAL_ADDRESS)
+#define ADDRESS_BATTERY_ENERGY_WH_X10     (FLASH_DATA_START_PHYSICAL_ADDRESS + 4)
+#define ADDRESS_BATTERY_TOTALS_CHECK      (FLASH_DATA_START_PHYSICAL_ADDRESS + 8)
+#define BATTERY_TOTALS_CHECK_KEY          0x5aa5c33cUL // erased EEPROM (all 0) is not valid
+
+static uint32_t ui32_m_saved_charge_mah = 0;
+static uint32_t ui32_m_saved_energy_wh_x10 = 0;
+
+static uint32_t eeprom_read_word(uint32_t ui32_address);
+static void eeprom_write_word(uint32_t ui32_address, uint32_t ui32_value);
+
+void eeprom_init(void)
+{
+  uint32_t ui32_charge_mah;
+  uint32_t ui32_energy_wh_x10;
+
+  FLASH_SetProgrammingTime(FLASH_PROGRAMTIME_STANDARD);
+
+  ui32_charge_mah = eeprom_read_word(ADDRESS_BATTERY_CHARGE_MAH);
+  ui32_energy_wh_x10 = eeprom_read_word(ADDRESS_BATTERY_ENERGY_WH_X10);
+
+  if (eeprom_read_word(ADDRESS_BATTERY_TOTALS_CHECK) == (ui32_charge_mah ^ ui32_energy_wh_x10 ^ BATTERY_TOTALS_CHECK_KEY))
+  {
+    ui32_g_battery_charge_mah = ui32_charge_mah;
+    ui32_g_battery_energy_wh_x10 = ui32_energy_wh_x10;
+    ui32_m_saved_charge_mah = ui32_charge_mah;
+    ui32_m_saved_energy_wh_x10 = ui32_energy_wh_x10;
+  }
+}
+
+// writes only if the totals changed. Each word takes about 6ms to program, call only when the motor is not running
+void eeprom_write_battery_totals(void)
+{
+  uint32_t ui32_charge_mah = ui32_g_battery_charge_mah;
+  uint32_t ui32_energy_wh_x10 = ui32_g_battery_energy_wh_x10;
+
+  if ((ui32_charge_mah == ui32_m_saved_charge_mah) &&
+      (ui32_energy_wh_x10 == ui32_m_saved_energy_wh_x10))
+    return;
+
+  FLASH_Unlock(FLASH_MEMTYPE_DATA);
+  eeprom_write_word(ADDRESS_BATTERY_CHARGE_MAH, ui32_charge_mah);
+  eeprom_write_word(ADDRESS_BATTERY_ENERGY_WH_X10, ui32_energy_wh_x10);
+  eeprom_write_word(ADDRESS_BATTERY_TOTALS_CHECK, ui32_charge_mah ^ ui32_energy_wh_x10 ^ BATTERY_TOTALS_CHECK_KEY);
+  FLASH_Lock(FLASH_MEMTYPE_DATA);
+
+  ui32_m_saved_charge_mah = ui32_charge_mah;
+  ui32_m_saved_energy_wh_x10 = ui32_energy_wh_x10;
+}
+
+static uint32_t eeprom_read_word(uint32_t ui32_address)
+{
+  uint32_t ui32_value;
+  uint8_t ui8_i;
+
+  // same bytes order as FLASH_ProgramWord()
+  for (ui8_i = 0; ui8_i < 4; ui8_i++)
+  {
+    *((uint8_t*) (&ui32_value) + ui8_i) = FLASH_ReadByte(ui32_address + ui8_i);
+  }
+
+  return ui32_value;
+}
+
+static void eeprom_write_word(uint32_t ui32_address, uint32_t ui32_value)
+{
+  FLASH_ProgramWord(ui32_address, ui32_value);
+  FLASH_WaitForLastOperation(FLASH_MEMTYPE_DATA);
+}
@@ -0,0 +1,17 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware/
+ *
+ * Copyright (C) Casainho, 2018.
+ *
+ * Released under the GPL License, Version 3
+ */
+
+#ifndef _EEPROM_H_
+#define _EEPROM_H_
+
+#include "main.h"
+
+void eeprom_init(void);
+void eeprom_write_battery_totals(void);
+
+#endif /* _EEPROM_H_ */
@@ -23,6 +23,7 @@
 #include "ebike_app.h"
 #include "torque_sensor.h"
 #include "lights.h"
+#include "eeprom.h"
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 //// Functions prototypes
@@ -77,6 +78,7 @@ int main(void)
   hall_sensor_init();
   pwm_init_bipolar_4q();
   motor_init();
+  eeprom_init();
   enableInterrupts();
 
   while(1)
@@ -13,10 +13,25 @@
 
 //#define DISABLE_PWM_CHANNELS_1_3
 
-#define PWM_CYCLES_COUNTER_MAX                    3800    // 5 erps minimum speed; 1/5 = 200ms; 200ms/52.6us = 3800
-#define PWM_CYCLES_SECOND                         19011L  // 1 / 64us(PWM period)
-#define PWM_DUTY_CYCLE_MAX                        254
-#define PWM_DUTY_CYCLE_MIN                        20
+// keep the max PWM interrupt time on ui16_g_pwm_isr_time_max, to be read with the debugger
+//#define PWM_ISR_TIME_MEASURE
+
+// the PWM interrupt code takes most of the PWM period at 420 (19kHz), it does not fit a shorter period
+#if (PWM_COUNTER_MAX < 420) || (PWM_COUNTER_MAX > 510)
+#error "PWM_COUNTER_MAX must be between 420 and 510"
+#endif
+
+// apply_throttle() maps the throttle to the motor current on 16 bits
+#if ADC_MOTOR_CURRENT_MAX > 255
+#error "ADC_MOTOR_CURRENT_MAX must be up to 255"
+#endif
+
+#define TIM1_CLOCK_HZ                             16000000L
+#define PWM_CYCLES_SECOND                         (TIM1_CLOCK_HZ / (2 * PWM_COUNTER_MAX)) // center aligned mode: PWM period = 2 * PWM_COUNTER_MAX
+#define PWM_CYCLES_COUNTER_MAX                    (PWM_CYCLES_SECOND / 5) // 5 erps minimum speed; 1/5 = 200ms
+#define PWM_DUTY_CYCLE_MAX                        PWM_COUNTER_MAX // each step is 1 TIMER1 count, max is the full counter range
+#define OVERMODULATION_MAX                        ((PWM_DUTY_CYCLE_MAX * 12) / 35) // 144 at 420: duty_cycle + (144 << 2): up to 10% more phase voltage, near six-step
+#define PWM_DUTY_CYCLE_MIN                        40
 #define MIDDLE_PWM_DUTY_CYCLE_MAX                 (PWM_DUTY_CYCLE_MAX/2)
 #define FIELD_WEAKENING_ANGLE_MAX                 8 // 8 * 1.4 = 11 | tested by Casainho on 2020.04.23 and gives up to 125% more motor speed
 
@@ -31,6 +46,11 @@
 #define MOTOR_OVER_SPEED_ERPS                     700 // 675 is equal to 120 cadence, as TSDZ2 has a reduction ratio of 41.8
 #define MOTOR_SPEED_FIELD_WEAKEANING_MIN          250
 
+// hall sensors fault and BEMF observer
+#define MOTOR_OBSERVER_MIN_ERPS                   60  // below this speed the BEMF is too low to estimate the rotor angle
+#define MOTOR_HALL_SENSORS_FAULT_CLEAR_EDGES      6   // valid hall sensors edges, one electrical rotation
+#define MOTOR_HALL_SENSORS_SECTOR_ANGLE           42  // 60 degrees hall sensors sector is 42.7 angle units, keep the predicted angle inside it
+
 // throttle
 #define THROTTLE_FILTER_COEFFICIENT               1   // see note below
 #define ADC_THROTTLE_THRESHOLD                    10  // value in ADC 8 bits step
@@ -96,8 +116,8 @@
 #define PAS_NUMBER_MAGNETS_X2                                     (PAS_NUMBER_MAGNETS * 2)
 #define PAS_NUMBER_MAGNETS_1_4                                    5
 #define PAS_NUMBER_MAGNETS_3_4                                    15
-#define PAS_ABSOLUTE_MAX_CADENCE_PWM_CYCLE_TICKS                  (7625 / PAS_NUMBER_MAGNETS)   // max hard limit to 150 RPM PAS cadence, see note below
-#define PAS_ABSOLUTE_MIN_CADENCE_PWM_CYCLE_TICKS                  (114375 / PAS_NUMBER_MAGNETS)  // min hard limit to 10 RPM PAS cadence, see note below
+#define PAS_ABSOLUTE_MAX_CADENCE_PWM_CYCLE_TICKS                  ((PWM_CYCLES_SECOND * 60 / 150) / PAS_NUMBER_MAGNETS) // max hard limit to 150 RPM PAS cadence, see note below
+#define PAS_ABSOLUTE_MIN_CADENCE_PWM_CYCLE_TICKS                  ((PWM_CYCLES_SECOND * 60 / 10) / PAS_NUMBER_MAGNETS)  // min hard limit to 10 RPM PAS cadence, see note below
 
 /*---------------------------------------------------------
   NOTE: regarding PAS
@@ -105,7 +125,7 @@
   PAS_NUMBER_MAGNETS = 20, was validated on August 2018 
   by Casainho and jbalat
 
-  x = (1/(150RPM/60)) / (0.000064)
+  x = (1/(150RPM/60)) * PWM_CYCLES_SECOND
   
   PAS_ABSOLUTE_MAX_CADENCE_PWM_CYCLE_TICKS = 
   (x / PAS_NUMBER_MAGNETS)
@@ -114,11 +134,12 @@
 
 
 // Wheel speed sensor
-#define WHEEL_SPEED_SENSOR_MAX_PWM_CYCLE_TICKS                    165   // something like 200 m/h with a 6'' wheel
-#define WHEEL_SPEED_SENSOR_MIN_PWM_CYCLE_TICKS                    39976 // could be a bigger number but will make for a slow detection of stopped wheel speed
+#define WHEEL_SPEED_SENSOR_MAX_PWM_CYCLE_TICKS                    (PWM_CYCLES_SECOND / 115)     // 8.7ms, something like 200 m/h with a 6'' wheel
+#define WHEEL_SPEED_SENSOR_MIN_PWM_CYCLE_TICKS                    (PWM_CYCLES_SECOND * 21 / 10) // 2.1 seconds, could be a bigger number but will make for a slow detection of stopped wheel speed
 
 // default values for ramp up
 #define DEFAULT_VALUE_RAMP_UP_AMPS_PER_SECOND_X10                 50  // 5.0 amps per second ramp up
+#define CURRENT_RAMP_UP_INVERSE_STEP_X10                          ((PWM_CYCLES_SECOND * ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512 * 10) / 512) // PWM cycles for 1 amp x10 ramp up per second
 
 
 // ADC battery voltage measurement
@@ -139,6 +160,18 @@
 
 // ADC battery current measurement and filter
 #define ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512               80 // 1A per 6.4 steps of ADC_10bits (0.156A per each ADC step)
+
+// battery charge and energy counters, in units of the battery current accumulated on each PWM cycle (ADC step * PWM cycle):
+// 1 mAh = 3.6 As; energy is (charge * ADC 10 bits battery voltage x8) >> 8
+#define BATTERY_CHARGE_PER_MAH                                    ((PWM_CYCLES_SECOND * 18432) / (ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512 * 10))
+#define BATTERY_ENERGY_PER_WH_X10                                 (((PWM_CYCLES_SECOND * 23040) / ((ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512 * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512) / 16)) * 8)
+#define BATTERY_TOTALS_SAVE_INTERVAL                              600 // 30 seconds (ebike_app_controller() runs every 50ms), limits data EEPROM writes
+
+// battery internal resistance estimation, in ADC 10 bits voltage steps per ADC 10 bits current step x256 (0.2 ohms = 93)
+#define BATTERY_RESISTANCE_CURRENT_STEP_MIN                       19  // 3A, smaller current steps have a voltage step of few ADC steps only
+#define BATTERY_RESISTANCE_X256_MAX                               512 // 1.1 ohms, bigger values are not from the battery
+#define BATTERY_RESISTANCE_REFERENCE_CYCLES                       100 // about 0.5 seconds of motor_controller() calls, the battery open circuit voltage does not change meanwhile
+
 #define READ_BATTERY_CURRENT_FILTER_COEFFICIENT                   2
 #define READ_MOTOR_CURRENT_FILTER_COEFFICIENT                     2
 #define READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT                   2
@@ -154,9 +187,16 @@
 
 
 
+// torque sensor ADC samples with the scan conversion started up to this number of TIM2 counts (2.5us) after
+// TORQUE_SENSOR_EXCITATION_PHASE are in phase with the excitation pulse. At PWM_COUNTER_MAX 420 that is 1 of each 8 PWM cycles
+#define TORQUE_SENSOR_EXCITATION_PHASE_WINDOW                     20
+
 // motor temperature filter coefficient 
 #define READ_MOTOR_TEMPERATURE_FILTER_COEFFICIENT                 5
 
+// motor thermal model, updated by ebike_app_controller() that runs every 50ms
+#define MOTOR_THERMAL_MODEL_TICKS_SECOND                          20
+
 
 
 #endif // _MAIN_H_
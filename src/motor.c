@@ -27,113 +27,435 @@
 #include "math.h"
 #include "main.h"
 
-#define SVM_TABLE_LEN   256
+#define SVM_TABLE_LEN   1024 // 4 entries per each of the 256 angle units: 0.35 degrees steps
+#define SVM_TABLE_MASK  (SVM_TABLE_LEN - 1)
+#define MIDDLE_SVM_TABLE   127
 #define SIN_TABLE_LEN   60
+#define DUTY_CYCLE_INVERSE_TABLE_LEN   256
 
 uint8_t ui8_svm_table [SVM_TABLE_LEN] =
 {
     239 ,
+    240 ,
+    240 ,
+    241 ,
+    241 ,
     241 ,
     242 ,
+    242 ,
+    242 ,
+    242 ,
+    243 ,
     243 ,
+    243 ,
+    244 ,
+    244 ,
+    245 ,
     245 ,
+    245 ,
+    246 ,
+    246 ,
     246 ,
+    246 ,
+    247 ,
+    247 ,
+    247 ,
     247 ,
     248 ,
+    248 ,
+    248 ,
+    248 ,
+    249 ,
     249 ,
+    249 ,
+    249 ,
+    250 ,
+    250 ,
     250 ,
+    250 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
     251 ,
     251 ,
     252 ,
+    252 ,
+    252 ,
+    252 ,
+    253 ,
     253 ,
     253 ,
+    253 ,
+    253 ,
+    253 ,
+    253 ,
+    253 ,
+    254 ,
+    254 ,
     254 ,
     254 ,
     254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
     255 ,
     255 ,
     255 ,
     255 ,
     255 ,
     255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    254 ,
+    254 ,
+    254 ,
     254 ,
     254 ,
     254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    253 ,
+    253 ,
     253 ,
     253 ,
+    253 ,
+    253 ,
+    253 ,
+    253 ,
+    252 ,
+    252 ,
+    252 ,
     252 ,
     251 ,
+    251 ,
+    251 ,
+    251 ,
+    250 ,
+    250 ,
+    250 ,
+    250 ,
+    250 ,
     250 ,
     250 ,
+    250 ,
+    249 ,
+    249 ,
+    249 ,
     249 ,
     248 ,
+    248 ,
+    248 ,
+    248 ,
     247 ,
+    247 ,
+    247 ,
+    246 ,
+    246 ,
     245 ,
+    245 ,
+    245 ,
+    244 ,
     244 ,
+    244 ,
+    244 ,
+    243 ,
+    243 ,
     243 ,
+    243 ,
+    242 ,
+    242 ,
     242 ,
+    241 ,
+    241 ,
+    240 ,
+    240 ,
     240 ,
     239 ,
+    239 ,
+    238 ,
+    238 ,
+    237 ,
     236 ,
+    235 ,
+    234 ,
+    232 ,
     231 ,
+    230 ,
+    229 ,
+    228 ,
     227 ,
+    226 ,
+    225 ,
+    223 ,
     222 ,
+    221 ,
+    220 ,
+    218 ,
     217 ,
+    216 ,
+    215 ,
+    213 ,
     212 ,
+    211 ,
+    210 ,
+    208 ,
     207 ,
+    206 ,
+    205 ,
+    203 ,
     202 ,
+    201 ,
+    200 ,
+    198 ,
     197 ,
+    196 ,
+    194 ,
+    193 ,
     191 ,
+    190 ,
+    189 ,
+    187 ,
     186 ,
+    185 ,
+    184 ,
+    182 ,
     181 ,
+    180 ,
+    179 ,
+    177 ,
     176 ,
+    175 ,
+    173 ,
+    172 ,
     170 ,
+    169 ,
+    168 ,
+    166 ,
     165 ,
+    164 ,
+    163 ,
+    161 ,
     160 ,
+    159 ,
+    157 ,
+    156 ,
     154 ,
+    153 ,
+    152 ,
+    150 ,
     149 ,
+    148 ,
+    147 ,
+    145 ,
     144 ,
+    143 ,
+    141 ,
+    140 ,
     138 ,
+    137 ,
+    136 ,
+    134 ,
     133 ,
+    132 ,
+    130 ,
+    129 ,
     127 ,
+    126 ,
+    125 ,
+    123 ,
     122 ,
+    121 ,
+    119 ,
+    118 ,
     116 ,
+    115 ,
+    114 ,
+    112 ,
     111 ,
+    110 ,
+    109 ,
+    107 ,
     106 ,
+    105 ,
+    103 ,
+    102 ,
     100 ,
-    95  ,
-    89  ,
-    84  ,
-    79  ,
-    74  ,
-    68  ,
-    63  ,
-    58  ,
-    53  ,
-    48  ,
-    43  ,
-    38  ,
-    33  ,
-    28  ,
-    23  ,
-    18  ,
-    16  ,
-    14  ,
-    13  ,
-    12  ,
-    10  ,
+    99 ,
+    98 ,
+    96 ,
+    95 ,
+    94 ,
+    92 ,
+    91 ,
+    89 ,
+    88 ,
+    87 ,
+    85 ,
+    84 ,
+    83 ,
+    82 ,
+    80 ,
+    79 ,
+    78 ,
+    77 ,
+    75 ,
+    74 ,
+    73 ,
+    71 ,
+    70 ,
+    68 ,
+    67 ,
+    66 ,
+    64 ,
+    63 ,
+    62 ,
+    61 ,
+    59 ,
+    58 ,
+    57 ,
+    56 ,
+    54 ,
+    53 ,
+    52 ,
+    51 ,
+    49 ,
+    48 ,
+    47 ,
+    46 ,
+    44 ,
+    43 ,
+    42 ,
+    41 ,
+    39 ,
+    38 ,
+    37 ,
+    36 ,
+    34 ,
+    33 ,
+    32 ,
+    31 ,
+    29 ,
+    28 ,
+    27 ,
+    26 ,
+    24 ,
+    23 ,
+    22 ,
+    21 ,
+    19 ,
+    18 ,
+    18 ,
+    17 ,
+    17 ,
+    16 ,
+    16 ,
+    15 ,
+    15 ,
+    14 ,
+    14 ,
+    14 ,
+    13 ,
+    13 ,
+    13 ,
+    13 ,
+    12 ,
+    12 ,
+    12 ,
+    11 ,
+    11 ,
+    10 ,
+    10 ,
+    10 ,
+    9 ,
+    9 ,
+    9 ,
     9 ,
     8 ,
+    8 ,
+    8 ,
+    8 ,
     7 ,
+    7 ,
+    7 ,
+    7 ,
+    6 ,
     6 ,
+    6 ,
+    6 ,
+    5 ,
+    5 ,
     5 ,
+    5 ,
+    4 ,
+    4 ,
+    4 ,
     4 ,
     3 ,
     3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    2 ,
     2 ,
+    2 ,
+    2 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
     1 ,
     1 ,
     1 ,
+    1 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
     0 ,
     0 ,
     0 ,
@@ -143,39 +465,174 @@ uint8_t ui8_svm_table [SVM_TABLE_LEN] =
     0 ,
     0 ,
     0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    1 ,
+    1 ,
+    1 ,
     1 ,
     1 ,
+    1 ,
+    1 ,
+    1 ,
+    2 ,
+    2 ,
+    2 ,
+    2 ,
+    2 ,
     2 ,
     2 ,
+    2 ,
+    3 ,
+    3 ,
+    3 ,
     3 ,
     4 ,
+    4 ,
+    4 ,
+    4 ,
     5 ,
+    5 ,
+    5 ,
+    5 ,
+    6 ,
+    6 ,
+    6 ,
+    6 ,
     6 ,
     6 ,
+    6 ,
+    7 ,
+    7 ,
+    8 ,
+    8 ,
     8 ,
     9 ,
-    10  ,
-    11  ,
-    12  ,
-    14  ,
-    15  ,
-    17  ,
-    15  ,
-    14  ,
-    12  ,
-    11  ,
-    10  ,
     9 ,
+    9 ,
+    9 ,
+    10 ,
+    10 ,
+    10 ,
+    10 ,
+    11 ,
+    11 ,
+    11 ,
+    11 ,
+    12 ,
+    12 ,
+    12 ,
+    13 ,
+    13 ,
+    14 ,
+    14 ,
+    14 ,
+    15 ,
+    15 ,
+    15 ,
+    16 ,
+    16 ,
+    17 ,
+    17 ,
+    17 ,
+    16 ,
+    16 ,
+    15 ,
+    15 ,
+    15 ,
+    14 ,
+    14 ,
+    14 ,
+    13 ,
+    13 ,
+    12 ,
+    12 ,
+    12 ,
+    11 ,
+    11 ,
+    11 ,
+    11 ,
+    10 ,
+    10 ,
+    10 ,
+    10 ,
+    9 ,
+    9 ,
+    9 ,
+    9 ,
+    8 ,
+    8 ,
     8 ,
+    7 ,
+    7 ,
+    6 ,
+    6 ,
+    6 ,
+    6 ,
+    6 ,
     6 ,
     6 ,
     5 ,
+    5 ,
+    5 ,
+    5 ,
+    4 ,
     4 ,
+    4 ,
+    4 ,
+    3 ,
+    3 ,
     3 ,
+    3 ,
+    2 ,
+    2 ,
+    2 ,
+    2 ,
+    2 ,
+    2 ,
     2 ,
     2 ,
     1 ,
     1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
+    0 ,
     0 ,
     0 ,
     0 ,
@@ -185,109 +642,423 @@ uint8_t ui8_svm_table [SVM_TABLE_LEN] =
     0 ,
     0 ,
     0 ,
+    0 ,
+    0 ,
+    0 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
     1 ,
     1 ,
     1 ,
+    1 ,
+    1 ,
+    1 ,
+    1 ,
+    2 ,
+    2 ,
+    2 ,
     2 ,
     3 ,
     3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    3 ,
+    4 ,
+    4 ,
     4 ,
+    4 ,
+    5 ,
+    5 ,
+    5 ,
     5 ,
     6 ,
+    6 ,
+    6 ,
+    6 ,
     7 ,
+    7 ,
+    7 ,
+    7 ,
+    8 ,
+    8 ,
+    8 ,
     8 ,
     9 ,
-    10  ,
-    12  ,
-    13  ,
-    14  ,
-    16  ,
-    18  ,
-    23  ,
-    28  ,
-    33  ,
-    38  ,
-    43  ,
-    48  ,
-    53  ,
-    58  ,
-    63  ,
-    68  ,
-    74  ,
-    79  ,
-    84  ,
-    89  ,
-    95  ,
+    9 ,
+    9 ,
+    9 ,
+    10 ,
+    10 ,
+    10 ,
+    11 ,
+    11 ,
+    12 ,
+    12 ,
+    12 ,
+    13 ,
+    13 ,
+    13 ,
+    13 ,
+    14 ,
+    14 ,
+    14 ,
+    15 ,
+    15 ,
+    16 ,
+    16 ,
+    17 ,
+    17 ,
+    18 ,
+    18 ,
+    19 ,
+    21 ,
+    22 ,
+    23 ,
+    24 ,
+    26 ,
+    27 ,
+    28 ,
+    29 ,
+    31 ,
+    32 ,
+    33 ,
+    34 ,
+    36 ,
+    37 ,
+    38 ,
+    39 ,
+    41 ,
+    42 ,
+    43 ,
+    44 ,
+    46 ,
+    47 ,
+    48 ,
+    49 ,
+    51 ,
+    52 ,
+    53 ,
+    54 ,
+    56 ,
+    57 ,
+    58 ,
+    59 ,
+    61 ,
+    62 ,
+    63 ,
+    64 ,
+    66 ,
+    67 ,
+    68 ,
+    70 ,
+    71 ,
+    73 ,
+    74 ,
+    75 ,
+    77 ,
+    78 ,
+    79 ,
+    80 ,
+    82 ,
+    83 ,
+    84 ,
+    85 ,
+    87 ,
+    88 ,
+    89 ,
+    91 ,
+    92 ,
+    94 ,
+    95 ,
+    96 ,
+    98 ,
+    99 ,
     100 ,
+    102 ,
+    103 ,
+    105 ,
     106 ,
+    107 ,
+    109 ,
+    110 ,
     111 ,
+    112 ,
+    114 ,
+    115 ,
     116 ,
+    118 ,
+    119 ,
+    121 ,
     122 ,
+    123 ,
+    125 ,
+    126 ,
     127 ,
+    129 ,
+    130 ,
+    132 ,
     133 ,
+    134 ,
+    136 ,
+    137 ,
     138 ,
+    140 ,
+    141 ,
+    143 ,
     144 ,
+    145 ,
+    147 ,
+    148 ,
     149 ,
+    150 ,
+    152 ,
+    153 ,
     154 ,
+    156 ,
+    157 ,
+    159 ,
     160 ,
+    161 ,
+    163 ,
+    164 ,
     165 ,
+    166 ,
+    168 ,
+    169 ,
     170 ,
+    172 ,
+    173 ,
+    175 ,
     176 ,
+    177 ,
+    179 ,
+    180 ,
     181 ,
+    182 ,
+    184 ,
+    185 ,
     186 ,
+    187 ,
+    189 ,
+    190 ,
     191 ,
+    193 ,
+    194 ,
+    196 ,
     197 ,
+    198 ,
+    200 ,
+    201 ,
     202 ,
+    203 ,
+    205 ,
+    206 ,
     207 ,
+    208 ,
+    210 ,
+    211 ,
     212 ,
+    213 ,
+    215 ,
+    216 ,
     217 ,
+    218 ,
+    220 ,
+    221 ,
     222 ,
+    223 ,
+    225 ,
+    226 ,
     227 ,
+    228 ,
+    229 ,
+    230 ,
     231 ,
+    232 ,
+    234 ,
+    235 ,
     236 ,
+    237 ,
+    238 ,
+    238 ,
+    239 ,
     239 ,
     240 ,
+    240 ,
+    240 ,
+    241 ,
+    241 ,
     242 ,
+    242 ,
+    242 ,
+    243 ,
+    243 ,
     243 ,
+    243 ,
+    244 ,
+    244 ,
+    244 ,
     244 ,
     245 ,
+    245 ,
+    245 ,
+    246 ,
+    246 ,
+    247 ,
     247 ,
+    247 ,
+    248 ,
     248 ,
+    248 ,
+    248 ,
+    249 ,
+    249 ,
     249 ,
+    249 ,
+    250 ,
+    250 ,
+    250 ,
+    250 ,
+    250 ,
+    250 ,
     250 ,
     250 ,
     251 ,
+    251 ,
+    251 ,
+    251 ,
+    252 ,
     252 ,
+    252 ,
+    252 ,
+    253 ,
+    253 ,
     253 ,
     253 ,
+    253 ,
+    253 ,
+    253 ,
+    253 ,
+    254 ,
+    254 ,
+    254 ,
     254 ,
     254 ,
     254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
     255 ,
     255 ,
     255 ,
     255 ,
     255 ,
     255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    255 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
     254 ,
     254 ,
     254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    254 ,
+    253 ,
+    253 ,
     253 ,
     253 ,
+    253 ,
+    253 ,
+    253 ,
+    253 ,
+    252 ,
+    252 ,
+    252 ,
     252 ,
     251 ,
     251 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
+    251 ,
+    250 ,
+    250 ,
     250 ,
+    250 ,
+    249 ,
+    249 ,
+    249 ,
     249 ,
     248 ,
+    248 ,
+    248 ,
+    248 ,
     247 ,
+    247 ,
+    247 ,
+    247 ,
+    246 ,
     246 ,
+    246 ,
+    246 ,
+    245 ,
     245 ,
+    245 ,
+    244 ,
+    244 ,
+    243 ,
     243 ,
+    243 ,
+    242 ,
+    242 ,
     242 ,
+    242 ,
+    241 ,
     241 ,
+    241 ,
+    240 ,
+    240 ,
+    239 ,
     239 ,
+    239 ,
+    238 ,
     238 ,
+    238 ,
+    239 ,
+    239 ,
 };
 
 uint8_t ui8_sin_table [SIN_TABLE_LEN] =
@@ -354,18 +1125,279 @@ uint8_t ui8_sin_table [SIN_TABLE_LEN] =
     127
 };
 
+// inverse of duty_cycle: 65536 / duty_cycle, rounded up and limited to 16 bits, with 0 for duty_cycle = 0
+const uint16_t ui16_duty_cycle_inverse_x65536 [DUTY_CYCLE_INVERSE_TABLE_LEN] =
+{
+    0,
+    65535,
+    32768,
+    21846,
+    16384,
+    13108,
+    10923,
+    9363,
+    8192,
+    7282,
+    6554,
+    5958,
+    5462,
+    5042,
+    4682,
+    4370,
+    4096,
+    3856,
+    3641,
+    3450,
+    3277,
+    3121,
+    2979,
+    2850,
+    2731,
+    2622,
+    2521,
+    2428,
+    2341,
+    2260,
+    2185,
+    2115,
+    2048,
+    1986,
+    1928,
+    1873,
+    1821,
+    1772,
+    1725,
+    1681,
+    1639,
+    1599,
+    1561,
+    1525,
+    1490,
+    1457,
+    1425,
+    1395,
+    1366,
+    1338,
+    1311,
+    1286,
+    1261,
+    1237,
+    1214,
+    1192,
+    1171,
+    1150,
+    1130,
+    1111,
+    1093,
+    1075,
+    1058,
+    1041,
+    1024,
+    1009,
+    993,
+    979,
+    964,
+    950,
+    937,
+    924,
+    911,
+    898,
+    886,
+    874,
+    863,
+    852,
+    841,
+    830,
+    820,
+    810,
+    800,
+    790,
+    781,
+    772,
+    763,
+    754,
+    745,
+    737,
+    729,
+    721,
+    713,
+    705,
+    698,
+    690,
+    683,
+    676,
+    669,
+    662,
+    656,
+    649,
+    643,
+    637,
+    631,
+    625,
+    619,
+    613,
+    607,
+    602,
+    596,
+    591,
+    586,
+    580,
+    575,
+    570,
+    565,
+    561,
+    556,
+    551,
+    547,
+    542,
+    538,
+    533,
+    529,
+    525,
+    521,
+    517,
+    512,
+    509,
+    505,
+    501,
+    497,
+    493,
+    490,
+    486,
+    482,
+    479,
+    475,
+    472,
+    469,
+    465,
+    462,
+    459,
+    456,
+    452,
+    449,
+    446,
+    443,
+    440,
+    437,
+    435,
+    432,
+    429,
+    426,
+    423,
+    421,
+    418,
+    415,
+    413,
+    410,
+    408,
+    405,
+    403,
+    400,
+    398,
+    395,
+    393,
+    391,
+    388,
+    386,
+    384,
+    382,
+    379,
+    377,
+    375,
+    373,
+    371,
+    369,
+    367,
+    365,
+    363,
+    361,
+    359,
+    357,
+    355,
+    353,
+    351,
+    349,
+    347,
+    345,
+    344,
+    342,
+    340,
+    338,
+    337,
+    335,
+    333,
+    331,
+    330,
+    328,
+    327,
+    325,
+    323,
+    322,
+    320,
+    319,
+    317,
+    316,
+    314,
+    313,
+    311,
+    310,
+    308,
+    307,
+    305,
+    304,
+    303,
+    301,
+    300,
+    298,
+    297,
+    296,
+    294,
+    293,
+    292,
+    290,
+    289,
+    288,
+    287,
+    285,
+    284,
+    283,
+    282,
+    281,
+    279,
+    278,
+    277,
+    276,
+    275,
+    274,
+    272,
+    271,
+    270,
+    269,
+    268,
+    267,
+    266,
+    265,
+    264,
+    263,
+    262,
+    261,
+    260,
+    259,
+    258
+};
+
 uint16_t ui16_PWM_cycles_counter = 1;
-uint16_t ui16_PWM_cycles_counter_6 = 1;
 uint16_t ui16_PWM_cycles_counter_total = 0xffff;
 
 uint16_t ui16_max_motor_speed_erps = (uint16_t) MOTOR_OVER_SPEED_ERPS;
 static volatile uint16_t ui16_motor_speed_erps = 0;
-uint8_t ui8_svm_table_index = 0;
+uint16_t ui16_svm_table_index_x256 = 0;
+uint16_t ui16_svm_table_index = 0;
 uint8_t ui8_motor_rotor_absolute_angle;
-uint8_t ui8_motor_rotor_angle;
+uint16_t ui16_motor_rotor_angle_x256;
 
 volatile uint8_t ui8_g_foc_angle = 0;
-uint8_t ui8_interpolation_angle = 0;
+uint16_t ui16_interpolation_angle_step_x256 = 0;
 uint16_t ui16_foc_angle_accumulated = 0;
 
 uint8_t ui8_motor_commutation_type = BLOCK_COMMUTATION;
@@ -373,24 +1405,58 @@ uint8_t ui8_motor_commutation_type = BLOCK_COMMUTATION;
 volatile uint8_t ui8_g_hall_sensors_state = 0;
 uint8_t ui8_hall_sensors_state_last = 0;
 
+// hall sensors fault and BEMF observer
+volatile uint8_t ui8_g_hall_sensors_fault = 0;
+volatile uint8_t ui8_g_overcurrent_fault = 0;
+volatile uint8_t ui8_g_overcurrent_fault_counter = 0;
+volatile uint8_t ui8_g_brake_cutoff = 0;
+#ifdef PWM_ISR_TIME_MEASURE
+volatile uint16_t ui16_g_pwm_isr_time_max = 0;
+#endif
+
+// battery charge and energy totals, loaded from and saved to data EEPROM
+uint32_t ui32_g_battery_charge_mah = 0;
+uint32_t ui32_g_battery_energy_wh_x10 = 0;
+static volatile uint32_t ui32_m_battery_charge_accumulated = 0;
+static uint32_t ui32_m_battery_charge = 0;
+static uint32_t ui32_m_battery_charge_mah_fraction = 0;
+static uint32_t ui32_m_battery_energy_wh_x10_fraction = 0;
+static uint8_t ui8_m_hall_sensors_valid_edges = 0;
+static uint8_t ui8_m_hall_sensors_last_angle_valid = 0;
+static volatile uint8_t ui8_m_observer_enabled = 0;
+static uint16_t ui16_m_observer_angle_x256 = 0;
+static volatile uint16_t ui16_m_observer_angle_step_x256 = 0;
+static uint32_t ui32_m_observer_erps_per_volt_accumulated = 0;
+static uint16_t ui16_m_observer_erps_per_volt_x256 = 0;
+
+// low speed rotor angle prediction inside the hall sensors sector
+static uint8_t ui8_m_sector_edges = 0;
+static uint16_t ui16_m_sector_pwm_cycles = 0;
+static uint16_t ui16_m_sector_pwm_cycles_last = 0;
+static uint16_t ui16_m_sector_angle_x256 = 0;
+static uint16_t ui16_m_sector_angle_step_x256 = 0;
+
 uint8_t ui8_half_erps_flag = 0;
 
-volatile uint8_t ui8_g_duty_cycle = 0;
-static volatile uint8_t ui8_m_duty_cycle_target;
+volatile uint16_t ui16_g_duty_cycle = 0;
+static volatile uint16_t ui16_m_duty_cycle_target;
 uint16_t ui16_duty_cycle_ramp_up_inverse_step;
 uint16_t ui16_duty_cycle_ramp_down_inverse_step;
 uint16_t ui16_counter_duty_cycle_ramp_up = 0;
 uint16_t ui16_counter_duty_cycle_ramp_down = 0;
 
+volatile uint8_t ui8_g_overmodulation = 0;
+
 volatile uint8_t ui8_g_field_weakening_angle = 0;
 volatile uint8_t ui8_g_field_weakening_enable = 0;
 volatile uint8_t ui8_g_field_weakening_enable_state = 0;
-uint16_t ui16_counter_field_weakening_ramp_up = 0;
-uint16_t ui16_counter_field_weakening_ramp_down = 0;
+uint16_t ui16_counter_field_weakening = 0;
+static uint8_t ui8_m_counter_field_weakening_ramp_up = 0;
+static volatile uint8_t ui8_m_field_weakening_angle_target = 0;
 
-uint8_t ui8_phase_a_voltage;
-uint8_t ui8_phase_b_voltage;
-uint8_t ui8_phase_c_voltage;
+uint16_t ui16_phase_a_voltage;
+uint16_t ui16_phase_b_voltage;
+uint16_t ui16_phase_c_voltage;
 uint16_t ui16_value;
 
 uint16_t ui16_counter_adc_current_ramp_up = 0;
@@ -403,9 +1469,33 @@ volatile uint16_t ui16_main_loop_wdt_cnt_1 = 0;
 volatile uint8_t ui8_adc_battery_voltage_cut_off = 0xff; // safe value so controller will not discharge the battery if not receiving a lower value from the LCD
 uint16_t ui16_adc_battery_voltage_accumulated = 0;
 uint16_t ui16_adc_battery_voltage_filtered_10b;
+uint16_t ui16_adc_battery_voltage_filtered_x8;
+
+// oversampling: the interrupt sums the battery voltage and current samples of every PWM cycle, read_adc_oversampling()
+// takes the sums on each motor_controller() and calculates the average values with 3 more bits (x8)
+static volatile uint32_t ui32_m_adc_battery_voltage_accumulated = 0;
+static volatile uint16_t ui16_m_adc_samples = 0;
+static uint16_t ui16_m_adc_battery_voltage_x8 = 0;
+static uint16_t ui16_m_adc_battery_current_x8 = 0;
+
+// torque sensor samples in phase with the excitation pulse, motor_get_adc_torque_sensor_x4() takes them
+static volatile uint32_t ui32_m_adc_torque_sensor_accumulated = 0;
+static volatile uint16_t ui16_m_adc_torque_sensor_samples = 0;
+static uint8_t ui8_m_adc_torque_sensor_in_phase = 0;
+
+// battery internal resistance and open circuit voltage
+static uint16_t ui16_m_battery_resistance_accumulated_x256 = 0;
+static uint16_t ui16_m_battery_resistance_x256 = 0; // 0 while not yet estimated
+static uint16_t ui16_m_battery_resistance_voltage_x8 = 0;
+static uint16_t ui16_m_battery_resistance_current = 0;
+static uint8_t ui8_m_battery_resistance_counter = 0;
+static uint16_t ui16_m_battery_voltage_ocv_x8 = 0;
+static volatile uint8_t ui8_m_battery_voltage_low = 1;
+static volatile uint8_t ui8_m_adc_battery_voltage_cut_off_min = 0xff;
 
 uint16_t ui16_adc_battery_current_accumulated = 0;
 volatile uint16_t ui16_g_adc_battery_current_filtered;
+volatile uint16_t ui16_g_adc_battery_current_filtered_x8;
 uint16_t ui16_adc_motor_current_accumulated = 0;
 volatile uint16_t ui16_g_adc_motor_current_filtered;
 
@@ -438,18 +1528,28 @@ uint8_t ui8_wheel_speed_sensor_state_old = 1;
 uint16_t ui16_wheel_speed_sensor_counter = 0;
 uint8_t ui8_wheel_speed_sensor_change_counter = 0;
 
+void read_adc_oversampling(void);
 void read_battery_voltage(void);
 void read_battery_current(void);
 void read_motor_current(void);
 void calc_foc_angle(void);
+void calc_bemf_observer(void);
+void calc_field_weakening(void);
+void calc_battery_totals(void);
+void calc_battery_resistance(void);
 uint8_t asin_table(uint8_t ui8_inverted_angle_x128);
 
 void motor_controller(void)
 {
+  read_adc_oversampling();
   read_battery_voltage();
   read_battery_current();
   read_motor_current();
   calc_foc_angle();
+  calc_bemf_observer();
+  calc_field_weakening();
+  calc_battery_totals();
+  calc_battery_resistance();
 }
 
 
@@ -458,11 +1558,23 @@ void motor_controller(void)
 // Hall sensor B positivie to negative transition | BEMF phase A at max value / top of sinewave
 // Hall sensor C positive to negative transition | BEMF phase C at max value / top of sinewave
 
-// runs every 64us (PWM frequency)
-// Measured on 2020.01.02 by Casainho, the interrupt code takes about 42us which is about 66% of the total 64us
+// runs every PWM cycle, 1 / PWM_CYCLES_SECOND (52.5us at 19kHz, PWM_COUNTER_MAX 420)
+// Measured on 2020.01.02 by Casainho at 19kHz, the interrupt code took about 42us which is about 80% of the total 52.5us.
+// Not measured after the 16 bits duty_cycle and angle changes: enable PWM_ISR_TIME_MEASURE on main.h and read
+// ui16_g_pwm_isr_time_max with the debugger, in TIMER1 counts of 62.5ns (672 counts = 42us, 840 counts = full period)
+// Removed since: the OC4 scheduling, the svm table interpolations, the dead time compensation table lookups and the
+// wait for the battery current conversion (the oversampling runs during it)
 void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
 {
   uint8_t ui8_temp;
+  uint8_t ui8_temp_next;
+  uint8_t ui8_hall_sensors_backward;
+  uint8_t ui8_pll_error_negative;
+  uint8_t ui8_duty_cycle_low;
+  uint8_t ui8_duty_cycle_high;
+  uint8_t ui8_dead_time_compensation_max;
+  uint16_t ui16_temp;
+  uint32_t ui32_temp;
   uint16_t ui16_adc_target_motor_max_current;
 
   /****************************************************************************/
@@ -475,9 +1587,36 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
   
   // start ADC1 conversion
   ADC1->CR1 |= ADC1_CR1_ADON;
+
+  // while the conversion runs (14 ADC clocks, 1.75us): battery voltage oversampling, read_adc_oversampling() takes
+  // it. The battery voltage and torque sensor are from the buffer of the scan conversion of the previous PWM cycle,
+  // this conversion only writes the battery current one
+  ui32_m_adc_battery_voltage_accumulated += UI16_ADC_10_BIT_BATTERY_VOLTAGE;
+  ++ui16_m_adc_samples;
+
+  // torque sensor, when the scan conversion of the previous PWM cycle was in phase with the excitation pulse
+  if (ui8_m_adc_torque_sensor_in_phase)
+  {
+    ui32_m_adc_torque_sensor_accumulated += UI16_ADC_10_BIT_TORQUE_SENSOR;
+    ++ui16_m_adc_torque_sensor_samples;
+  }
+
   while (!(ADC1->CSR & ADC1_FLAG_EOC)) ;
   ui16_g_adc_battery_current = UI16_ADC_10_BIT_BATTERY_CURRENT;
 
+  // the ADC analog watchdog flags a current over ADC_CURRENT_CUTOFF: disable PWM now, instead of waiting for the
+  // current controller to reduce the duty_cycle. The ebike_app enables the motor again only after it stops.
+  if (ADC1->CSR & ADC1_CSR_AWD)
+  {
+    motor_disable_pwm();
+    ui16_g_duty_cycle = 0;
+    ui8_g_overmodulation = 0;
+    ui8_g_field_weakening_angle = 0;
+    ui8_g_overcurrent_fault = 1;
+    if (ui8_g_overcurrent_fault_counter < 255)
+      ++ui8_g_overcurrent_fault_counter;
+  }
+
   // we ignore low values of the battery current < 5 to avoid issues with other consumers than the motor (such as integrated 6v lights)
   // Piecewise linear is better than a step, to avoid limit cycles.
   // in     --> out
@@ -492,22 +1631,38 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
     ui16_g_adc_battery_current -= 5; // 5 - 15 --> 0 - 10
     ui16_g_adc_battery_current += (ui16_g_adc_battery_current >> 1); // multiply by 1.5: 0 - 10 --> 0 - 15
   }
+
+  // battery charge oversampling: every sample, read_adc_oversampling() takes it
+  ui32_m_battery_charge_accumulated += ui16_g_adc_battery_current;
     
   // this shoud work but does not.......
 //  ui16_g_adc_battery_current = (((uint16_t) ADC1->DRH) << 8) | ((uint16_t) ADC1->DRL);
 
-  // calculate motor current ADC value
-  if (ui8_g_duty_cycle > 0)
+  // calculate motor current ADC value: (battery current << 8) / duty_cycle
+  // a division takes too long for the PWM cycle, so multiply by the inverse of duty_cycle from the table and shift.
+  // Max error to the division result is 1 ADC step for battery current < 256 and 4 ADC steps for the full 10 bits range.
+  // The table is for the 8 bits duty_cycle (duty_cycle >> 1).
+  ui16_temp = ui16_duty_cycle_inverse_x65536 [(uint8_t) (ui16_g_duty_cycle >> 1)];
+  if (ui16_g_adc_battery_current < 256)
   {
-    ui16_g_adc_motor_current = ((ui16_g_adc_battery_current << 8) / ((uint16_t) ui8_g_duty_cycle));
+    // 8 bits * 16 bits as two 8 bits * 8 bits multiplications (STM8 MUL instruction)
+    ui8_temp = (uint8_t) ui16_g_adc_battery_current;
+    ui16_g_adc_motor_current = (((uint16_t) ui8_temp) * ((uint8_t) (ui16_temp >> 8))) +
+                               ((((uint16_t) ui8_temp) * ((uint8_t) ui16_temp)) >> 8);
   }
-  else
+  else // 40 amps or more, out of the normal range
   {
-    ui16_g_adc_motor_current = 0;
+    ui32_temp = (((uint32_t) ui16_g_adc_battery_current) * ui16_temp) >> 8;
+    if (ui32_temp > 0xffff)
+      ui32_temp = 0xffff;
+
+    ui16_g_adc_motor_current = (uint16_t) ui32_temp;
   }
 
   /****************************************************************************/
   // trigger ADC conversion of all channels (scan conversion, buffered)
+  // TIM2 counter is at most 159, so the low byte only. Counter values under the phase wrap to over the window
+  ui8_m_adc_torque_sensor_in_phase = ((uint8_t) (TIM2->CNTRL - TORQUE_SENSOR_EXCITATION_PHASE)) < TORQUE_SENSOR_EXCITATION_PHASE_WINDOW;
   ADC1->CR2 |= ADC1_CR2_SCAN; // enable scan mode
   ADC1->CSR = 0x07; // clear EOC flag first (selected also channel 7)
   ADC1->CR1 |= ADC1_CR1_ADON; // start ADC1 conversion
@@ -527,6 +1682,7 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
   if (ui8_g_hall_sensors_state != ui8_hall_sensors_state_last)
   {
     ui8_hall_sensors_state_last = ui8_g_hall_sensors_state;
+    ui8_temp = ui8_motor_rotor_absolute_angle;
 
     switch (ui8_g_hall_sensors_state)
     {
@@ -546,6 +1702,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         if (ui16_PWM_cycles_counter_total > 0) 
         {
           ui16_motor_speed_erps = ((uint16_t) PWM_CYCLES_SECOND) / ui16_PWM_cycles_counter_total;
+
+          // interpolation angle increment on each PWM cycle: 256 angle units each electrical rotation, x256
+          // (only one division each electrical rotation instead of one on each PWM cycle).
+          // With interpolation, the PLL on the hall sensors edges keeps the increment updated
+          if (ui8_motor_commutation_type == BLOCK_COMMUTATION)
+            ui16_interpolation_angle_step_x256 = 0xffff / ui16_PWM_cycles_counter_total;
         }
         else
         { 
@@ -559,6 +1721,8 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
           {
             ui8_motor_commutation_type = SINEWAVE_INTERPOLATION_60_DEGREES;
             ui8_g_ebike_app_state = EBIKE_APP_STATE_MOTOR_RUNNING;
+            ui8_m_sector_edges = 0;
+            ui16_m_sector_angle_step_x256 = 0;
           }
         }
         else
@@ -595,12 +1759,164 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
       ui8_motor_rotor_absolute_angle = (uint8_t) MOTOR_ROTOR_ANGLE_90;
       break;
 
+      // invalid state (0 or 7), keep the last valid rotor angle
       default:
-      return;
       break;
     }
 
-    ui16_PWM_cycles_counter_6 = 1;
+    // hall sensors fault detection: a valid state change is to the next or previous 60 degrees sector (42 or 43 angle units),
+    // an invalid state or a jump over sectors means that a hall sensor signal is broken
+    ui8_temp = ui8_motor_rotor_absolute_angle - ui8_temp;
+
+    // on the first valid state (power up or after the near zero speed resync) there is no valid last rotor angle to
+    // check the sequence with, it is not a sector change
+    if (ui8_m_hall_sensors_last_angle_valid == 0)
+    {
+      ui8_temp = 0;
+      if ((ui8_g_hall_sensors_state != 0) && (ui8_g_hall_sensors_state != 7))
+        ui8_m_hall_sensors_last_angle_valid = 1;
+    }
+
+    ui8_hall_sensors_backward = ui8_temp & 0x80;
+    if (ui8_hall_sensors_backward)
+      ui8_temp = -ui8_temp;
+
+    if ((ui8_g_hall_sensors_state == 0) ||
+        (ui8_g_hall_sensors_state == 7) ||
+        (ui8_temp && ((uint8_t) (ui8_temp - 40) > 5)))
+    {
+      ui8_g_hall_sensors_fault = 1;
+      ui8_m_hall_sensors_valid_edges = 0;
+
+      // switch to the BEMF observer, it needs a minimum motor speed and the motor BEMF constant learned before the fault
+      if ((ui8_m_observer_enabled == 0) &&
+          (ui16_motor_speed_erps >= MOTOR_OBSERVER_MIN_ERPS) &&
+          ui16_m_observer_erps_per_volt_x256)
+      {
+        ui8_m_observer_enabled = 1;
+        ui16_m_observer_angle_x256 = ui16_motor_rotor_angle_x256;
+      }
+    }
+    else if (ui8_temp)
+    {
+      // a valid hall sensors edge is an exact rotor position, use it to resync the observer
+      ui16_m_observer_angle_x256 = ((uint16_t) ui8_motor_rotor_absolute_angle) << 8;
+
+      // one electrical rotation with a valid sequence clears the fault and goes back to the hall sensors
+      if (ui8_g_hall_sensors_fault &&
+          (++ui8_m_hall_sensors_valid_edges >= MOTOR_HALL_SENSORS_FAULT_CLEAR_EDGES))
+      {
+        ui8_g_hall_sensors_fault = 0;
+
+        if (ui8_m_observer_enabled)
+        {
+          ui8_m_observer_enabled = 0;
+          ui16_PWM_cycles_counter = 1;
+          ui16_interpolation_angle_step_x256 = ui16_m_observer_angle_step_x256;
+        }
+      }
+    }
+
+    // new rotor sector
+    if (ui8_temp)
+    {
+      // Interpolation PLL: the hall sensors edge is the exact rotor angle, the error to the interpolated angle corrects
+      // the angle (3/4 of the error, to not jump) and the angle increment (error * increment >> 14, so the correction
+      // scales with the motor speed). Without it, the increment from the last electrical rotation time lags on
+      // acceleration and the angle snaps on each edge. An error over 90 degrees resyncs the angle.
+      if ((ui8_motor_commutation_type == SINEWAVE_INTERPOLATION_60_DEGREES) &&
+          (ui8_m_observer_enabled == 0))
+      {
+        ui16_temp = (((uint16_t) ui8_motor_rotor_absolute_angle) << 8) - ui16_motor_rotor_angle_x256;
+        if ((uint16_t) (ui16_temp + 0x3fff) > 0x7ffe)
+        {
+          ui16_motor_rotor_angle_x256 = ((uint16_t) ui8_motor_rotor_absolute_angle) << 8;
+        }
+        else
+        {
+          ui8_pll_error_negative = (uint8_t) (ui16_temp >> 15);
+          if (ui8_pll_error_negative)
+          {
+            ui16_temp = -ui16_temp;
+            ui16_motor_rotor_angle_x256 -= ui16_temp - (ui16_temp >> 2);
+          }
+          else
+          {
+            ui16_motor_rotor_angle_x256 += ui16_temp - (ui16_temp >> 2);
+          }
+
+          // error * increment >> 14, as 8 bits multiplications (STM8 MUL instruction)
+          ui8_temp = (uint8_t) (ui16_temp >> 8);
+          ui8_temp_next = (uint8_t) (ui16_interpolation_angle_step_x256 >> 8);
+          ui16_temp = ((((uint16_t) ((uint8_t) ui16_temp)) * ((uint8_t) ui16_interpolation_angle_step_x256)) >> 14) +
+                      ((((uint16_t) ((uint8_t) ui16_temp)) * ui8_temp_next) >> 6) +
+                      ((((uint16_t) ui8_temp) * ((uint8_t) ui16_interpolation_angle_step_x256)) >> 6) +
+                      ((((uint16_t) ui8_temp) * ui8_temp_next) << 2);
+
+          if (ui8_pll_error_negative)
+            ui16_interpolation_angle_step_x256 -= ui16_temp;
+          else
+            ui16_interpolation_angle_step_x256 += ui16_temp;
+        }
+      }
+
+      // Low speed rotor angle prediction inside the sector, for block commutation: the sector time is predicted from the
+      // last sector time and the acceleration (difference to the sector before). On the first edge after a standstill,
+      // the time since the motor was driven is used, it is longer than the real sector time so the angle does not
+      // go ahead of the rotor. Only one division on each edge.
+      ui16_m_sector_angle_x256 = 0;
+
+      if ((ui8_motor_commutation_type == BLOCK_COMMUTATION) &&
+          (ui8_g_hall_sensors_fault == 0) &&
+          (ui8_hall_sensors_backward == 0) &&
+          ui16_m_sector_pwm_cycles)
+      {
+        ui16_temp = ui16_m_sector_pwm_cycles;
+        if (ui8_m_sector_edges)
+        {
+          // last + (last - before): up to double of the last sector time when slowing down,
+          // limited to half of it when speeding up
+          if (ui16_temp >= ui16_m_sector_pwm_cycles_last)
+          {
+            ui16_temp += ui16_temp - ui16_m_sector_pwm_cycles_last;
+          }
+          else if ((ui16_m_sector_pwm_cycles_last - ui16_temp) > (ui16_temp >> 1))
+          {
+            ui16_temp -= ui16_temp >> 1;
+          }
+          else
+          {
+            ui16_temp -= ui16_m_sector_pwm_cycles_last - ui16_temp;
+          }
+        }
+        else
+        {
+          ui8_m_sector_edges = 1;
+        }
+
+        ui16_m_sector_pwm_cycles_last = ui16_m_sector_pwm_cycles;
+        ui16_m_sector_angle_step_x256 = ((uint16_t) (MOTOR_HALL_SENSORS_SECTOR_ANGLE << 8)) / ui16_temp;
+      }
+      else
+      {
+        ui8_m_sector_edges = 0;
+        ui16_m_sector_angle_step_x256 = 0;
+      }
+
+      ui16_m_sector_pwm_cycles = 0;
+    }
+  }
+
+  // PWM cycles on the current sector, while the motor is driven
+  if (ui16_g_duty_cycle == 0)
+  {
+    ui8_m_sector_edges = 0;
+    ui16_m_sector_pwm_cycles = 0;
+    ui16_m_sector_angle_step_x256 = 0;
+  }
+  else if (ui16_m_sector_pwm_cycles < ((uint16_t) PWM_CYCLES_COUNTER_MAX))
+  {
+    ui16_m_sector_pwm_cycles++;
   }
 
 
@@ -609,44 +1925,59 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
   if (ui16_PWM_cycles_counter < ((uint16_t) PWM_CYCLES_COUNTER_MAX))
   {
     ui16_PWM_cycles_counter++;
-    ui16_PWM_cycles_counter_6++;
   }
-  else // happens when motor is stopped or near zero speed
+  else if (ui8_m_observer_enabled == 0) // happens when motor is stopped or near zero speed
   {
     ui16_PWM_cycles_counter = 1; // don't put to 0 to avoid 0 divisions
-    ui16_PWM_cycles_counter_6 = 1;
     ui8_half_erps_flag = 0;
     ui16_motor_speed_erps = 0;
     ui16_PWM_cycles_counter_total = 0xffff;
     ui8_g_foc_angle = 0;
     ui8_motor_commutation_type = BLOCK_COMMUTATION;
     ui8_hall_sensors_state_last = 0; // this way we force execution of hall sensors code next time
+    ui8_m_hall_sensors_last_angle_valid = 0;
   }
   /****************************************************************************/
   
   
   // - calc interpolation angle and sinewave table index
+  // angles are x256 (8 bits fraction), the svm table index uses the 2 high bits of the fraction
 #define DO_INTERPOLATION 1 // may be useful to disable interpolation when debugging
+  if (ui8_m_observer_enabled)
+  {
+    // hall sensors fault: rotor angle from the BEMF observer and no motor speed measure from the hall sensors
+    ui16_m_observer_angle_x256 += ui16_m_observer_angle_step_x256;
+    ui16_motor_rotor_angle_x256 = ui16_m_observer_angle_x256;
+    ui8_half_erps_flag = 0;
+  }
+  else
 #if DO_INTERPOLATION == 1
   // calculate the interpolation angle (and it doesn't work when motor starts and at very low speeds)
   if (ui8_motor_commutation_type == SINEWAVE_INTERPOLATION_60_DEGREES)
   {
-    // division by 0: ui16_PWM_cycles_counter_total should never be 0
-    // TODO: verifiy if (ui16_PWM_cycles_counter_6 << 8) do not overflow
-    ui8_interpolation_angle = (ui16_PWM_cycles_counter_6 << 8) / ui16_PWM_cycles_counter_total; // this operations take 4.4us
-    ui8_motor_rotor_angle = ui8_motor_rotor_absolute_angle + ui8_interpolation_angle;
-    ui8_svm_table_index = ui8_motor_rotor_angle;
+    // the hall sensors edges correct this angle and the increment (PLL)
+    ui16_motor_rotor_angle_x256 += ui16_interpolation_angle_step_x256;
   }
   else
 #endif
+  if (ui16_m_sector_angle_step_x256)
+  {
+    // low speed: predicted rotor angle, that stops at the end of the sector if the next hall sensors edge is late
+    ui16_m_sector_angle_x256 += ui16_m_sector_angle_step_x256;
+    if (ui16_m_sector_angle_x256 > ((uint16_t) (MOTOR_HALL_SENSORS_SECTOR_ANGLE << 8)))
+      ui16_m_sector_angle_x256 = (uint16_t) (MOTOR_HALL_SENSORS_SECTOR_ANGLE << 8);
+
+    ui16_motor_rotor_angle_x256 = (((uint16_t) ui8_motor_rotor_absolute_angle) << 8) + ui16_m_sector_angle_x256;
+  }
+  else
   {
-    ui8_svm_table_index = ui8_motor_rotor_absolute_angle;
+    ui16_motor_rotor_angle_x256 = ((uint16_t) ui8_motor_rotor_absolute_angle) << 8;
   }
 
-  ui8_svm_table_index += ui8_g_foc_angle;
+  ui16_svm_table_index_x256 = ui16_motor_rotor_angle_x256 + (((uint16_t) ui8_g_foc_angle) << 8);
 
   // we need to put phase voltage 90 degrees ahead of rotor position, to get current 90 degrees ahead and have max torque per amp
-  ui8_svm_table_index -= 63;
+  ui16_svm_table_index_x256 -= (63 << 8);
 
   /****************************************************************************/
   // check brakes state
@@ -682,21 +2013,47 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
   ++ui8_current_controller_counter;
   ++ui16_motor_speed_controller_counter;
 
+#if BRAKE_FAST_CUTOFF
+  // cut the motor now instead of the duty_cycle ramp down, PWM outputs are enabled again by ebike_app after brake release
+  if (ui8_g_brakes_state)
+  {
+    if (ui8_g_brake_cutoff == 0)
+    {
+      motor_disable_pwm();
+      ui8_g_brake_cutoff = 1;
+    }
+
+    ui16_g_duty_cycle = 0;
+    ui8_g_overmodulation = 0;
+    ui8_g_field_weakening_angle = 0;
+  }
+  else
+#endif
   if (ui8_g_brakes_state ||
       (ui8_m_pas_min_cadence_flag && (ui8_g_throttle == 0)) ||
-      (UI8_ADC_BATTERY_VOLTAGE < ui8_adc_battery_voltage_cut_off))
+      ui8_m_battery_voltage_low ||
+      (UI8_ADC_BATTERY_VOLTAGE < ui8_m_adc_battery_voltage_cut_off_min))
   {
     if (ui8_g_field_weakening_angle)
     {
       --ui8_g_field_weakening_angle;
     }
-    else if (ui8_g_duty_cycle)
+    else if (ui8_g_overmodulation)
+    {
+      --ui8_g_overmodulation;
+    }
+    else if (ui16_g_duty_cycle > 1)
     {
-      --ui8_g_duty_cycle;
+      ui16_g_duty_cycle -= 2; // keep the ramp down time of the 8 bits duty_cycle
+    }
+    else
+    {
+      ui16_g_duty_cycle = 0;
     }
   }
   // do not control current at every PWM cycle, that will measure and control too fast. Use counter to limit
-  else if ((ui8_current_controller_counter > 14) &&
+  // control each 7 PWM cycles: a 9 bits duty_cycle step is half of a 8 bits step, same rate as 8 bits steps each 15 cycles
+  else if ((ui8_current_controller_counter > 6) &&
       ((ui16_g_adc_battery_current > ui16_g_adc_target_battery_max_current) ||
        (ui16_g_adc_motor_current > ui16_controller_adc_max_current)))
   {
@@ -704,9 +2061,13 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
     {
       --ui8_g_field_weakening_angle;
     }
-    else if (ui8_g_duty_cycle)
+    else if (ui8_g_overmodulation)
+    {
+      --ui8_g_overmodulation;
+    }
+    else if (ui16_g_duty_cycle)
     {
-      --ui8_g_duty_cycle;
+      --ui16_g_duty_cycle;
     }
   }
   else if ((ui16_motor_speed_controller_counter > 2000) && // test about every 100ms
@@ -716,133 +2077,216 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
     {
       --ui8_g_field_weakening_angle;
     }
-    else if (ui8_g_duty_cycle)
+    else if (ui8_g_overmodulation)
+    {
+      --ui8_g_overmodulation;
+    }
+    else if (ui16_g_duty_cycle)
     {
-      --ui8_g_duty_cycle;
+      --ui16_g_duty_cycle;
     }
   }
   else // nothing to limit, so adjust duty_cycle to duty_cycle_target, including ramping
-       // or adjust field weakening
+       // or adjust overmodulation or field weakening
   {
-    if ((ui8_g_duty_cycle >= PWM_DUTY_CYCLE_MAX) && // max voltage already applied to motor windings, enter or keep in field weakening state
-        ui8_g_field_weakening_enable_state)
+    if ((ui16_g_duty_cycle >= PWM_DUTY_CYCLE_MAX) && // max linear voltage already applied to motor windings, increase overmodulation
+        (ui16_m_duty_cycle_target >= PWM_DUTY_CYCLE_MAX) &&
+        (ui8_g_overmodulation < OVERMODULATION_MAX) &&
+        (ui8_g_field_weakening_angle == 0))
     {
-      if (ui16_g_adc_motor_current < ui16_controller_adc_max_current)
+      if (ui16_counter_duty_cycle_ramp_up++ >= ui16_duty_cycle_ramp_up_inverse_step)
       {
-        if (ui16_counter_field_weakening_ramp_up++ >= FIELD_WEAKENING_RAMP_UP_INVERSE_STEP)
-        {
-          ui16_counter_field_weakening_ramp_up = 0;
-
-          if (ui8_g_field_weakening_angle < FIELD_WEAKENING_ANGLE_MAX)
-            ++ui8_g_field_weakening_angle;
-        }
+        ui16_counter_duty_cycle_ramp_up = 0;
+        ++ui8_g_overmodulation;
       }
-      else if (ui16_g_adc_motor_current > ui16_controller_adc_max_current)
+    }
+    else if ((ui16_g_duty_cycle >= PWM_DUTY_CYCLE_MAX) && // max voltage already applied to motor windings, enter or keep in field weakening state
+        (ui8_g_overmodulation >= OVERMODULATION_MAX) &&
+        ui8_g_field_weakening_enable_state)
+    {
+      // reduce field weakening angle if motor current is over the max, else move it fast up to the target from
+      // calc_field_weakening() and keep increasing it slower while the voltage is saturated
+      if (ui16_counter_field_weakening++ >= FIELD_WEAKENING_INVERSE_STEP)
       {
-        if (ui16_counter_field_weakening_ramp_down++ >= FIELD_WEAKENING_RAMP_DOWN_INVERSE_STEP)
+        ui16_counter_field_weakening = 0;
+
+        if (ui16_g_adc_motor_current > ui16_controller_adc_max_current)
         {
-          ui16_counter_field_weakening_ramp_down = 0;
+          ui8_m_counter_field_weakening_ramp_up = 0;
 
           if (ui8_g_field_weakening_angle)
-          {
             --ui8_g_field_weakening_angle;
-          }
           else
-          {
-            --ui8_g_duty_cycle; // exit from field weakening state
-          }
+            --ui8_g_overmodulation; // exit from field weakening state
+        }
+        else if (ui8_g_field_weakening_angle < ui8_m_field_weakening_angle_target)
+        {
+          ++ui8_g_field_weakening_angle;
+        }
+        else if ((ui8_g_field_weakening_angle < FIELD_WEAKENING_ANGLE_MAX) &&
+                 (ui16_g_adc_motor_current < ui16_controller_adc_max_current) &&
+                 (++ui8_m_counter_field_weakening_ramp_up >= FIELD_WEAKENING_RAMP_UP_INVERSE_STEP))
+        {
+          ui8_m_counter_field_weakening_ramp_up = 0;
+          ++ui8_g_field_weakening_angle;
         }
       }
     }
     else
     {
-      if (ui8_m_duty_cycle_target > ui8_g_duty_cycle)
+      if (ui16_m_duty_cycle_target > ui16_g_duty_cycle)
       {
         if (ui16_counter_duty_cycle_ramp_up++ >= ui16_duty_cycle_ramp_up_inverse_step)
         {
           ui16_counter_duty_cycle_ramp_up = 0;
-          ++ui8_g_duty_cycle;
+          ++ui16_g_duty_cycle;
         }
       }
-      else if (ui8_m_duty_cycle_target < ui8_g_duty_cycle)
+      else if ((ui16_m_duty_cycle_target < ui16_g_duty_cycle) ||
+               ((ui16_m_duty_cycle_target < PWM_DUTY_CYCLE_MAX) && ui8_g_overmodulation))
       {
         if (ui16_counter_duty_cycle_ramp_down++ >= ui16_duty_cycle_ramp_down_inverse_step)
         {
           ui16_counter_duty_cycle_ramp_down = 0;
-          --ui8_g_duty_cycle;
+
+          // leave overmodulation first
+          if (ui8_g_overmodulation)
+            --ui8_g_overmodulation;
+          else
+            --ui16_g_duty_cycle;
         }
       }
     }
   }
 
-  ui8_svm_table_index += ui8_g_field_weakening_angle;
+  ui16_svm_table_index_x256 += ((uint16_t) ui8_g_field_weakening_angle) << 8;
 
   // disable field weakening only after leaving the field weakening state
   if (ui8_g_field_weakening_enable == 0 &&
-      ui8_g_duty_cycle < PWM_DUTY_CYCLE_MAX)
+      ui16_g_duty_cycle < PWM_DUTY_CYCLE_MAX)
     ui8_g_field_weakening_enable_state = 0;
 
-  if (ui8_current_controller_counter > 14)
+  if (ui8_current_controller_counter > 6)
     ui8_current_controller_counter = 0;
 
   /****************************************************************************/
   // calculate final PWM duty_cycle values to be applied to TIMER1
   // scale and apply PWM duty_cycle for the 3 phases
+  // each duty_cycle step is 1 TIMER1 count. (svm amplitude * duty_cycle) >> 8 is done with 8 bits * 8 bits
+  // multiplications (STM8 MUL instruction) of the svm amplitude by the duty_cycle low and high bytes.
+  // Overmodulation increases the duty_cycle over PWM_DUTY_CYCLE_MAX: the phases values are clipped to the TIMER1 counter
+  // range, and so the phase voltage moves from sinewave to six-step
+  ui16_temp = ui16_g_duty_cycle + (((uint16_t) ui8_g_overmodulation) << 2);
+  ui8_duty_cycle_low = (uint8_t) ui16_temp;
+  ui8_duty_cycle_high = (uint8_t) (ui16_temp >> 8);
+
+  // dead time compensation: during the dead time, phase voltage is high when phase current is negative and low when positive,
+  // so the phase value goes PWM_DEAD_TIME_COMPENSATION further from the middle, to the side of the phase current sign.
+  // Near the current zero crossing (about 8 degrees) the compensation is proportional to the svm table value, so a small
+  // angle error does not give a full step. The phase current lags the phase voltage by the FOC angle: the phase voltage
+  // svm values are used only while the FOC angle is inside that proportional range, otherwise no compensation.
+  ui8_dead_time_compensation_max = 0;
+  if (ui16_g_duty_cycle &&
+      (ui8_g_foc_angle <= PWM_DEAD_TIME_COMPENSATION_FOC_ANGLE_MAX))
+    ui8_dead_time_compensation_max = PWM_DEAD_TIME_COMPENSATION;
+
+  // svm table has 4 entries per angle unit: the index is the x256 angle rounded to 1/4 of the angle unit (0.35 degrees)
+  ui16_svm_table_index = (ui16_svm_table_index_x256 + 32) >> 6;
+
   // phase A is advanced 240 degrees over phase B
-  ui8_temp = ui8_svm_table [(uint8_t) (ui8_svm_table_index + 171 /* 240º */)];
-  if (ui8_temp > MIDDLE_PWM_DUTY_CYCLE_MAX)
+  ui8_temp = ui8_svm_table [(ui16_svm_table_index + 683 /* 240º */) & SVM_TABLE_MASK];
+  if (ui8_temp > MIDDLE_SVM_TABLE)
   {
-    ui16_value = ((uint16_t) (ui8_temp - MIDDLE_PWM_DUTY_CYCLE_MAX)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_a_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui8_temp;
+    ui8_temp -= MIDDLE_SVM_TABLE;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    ui16_phase_a_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui16_value;
   }
   else
   {
-    ui16_value = ((uint16_t) (MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_a_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp;
+    ui8_temp = MIDDLE_SVM_TABLE - ui8_temp;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    if (ui16_value < MIDDLE_PWM_DUTY_CYCLE_MAX)
+      ui16_phase_a_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui16_value;
+    else
+      ui16_phase_a_voltage = 0;
   }
 
   // phase B as reference phase
-  ui8_temp = ui8_svm_table [ui8_svm_table_index];
-  if (ui8_temp > MIDDLE_PWM_DUTY_CYCLE_MAX)
+  ui8_temp = ui8_svm_table [ui16_svm_table_index & SVM_TABLE_MASK];
+  if (ui8_temp > MIDDLE_SVM_TABLE)
   {
-    ui16_value = ((uint16_t) (ui8_temp - MIDDLE_PWM_DUTY_CYCLE_MAX)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_b_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui8_temp;
+    ui8_temp -= MIDDLE_SVM_TABLE;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    ui16_phase_b_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui16_value;
   }
   else
   {
-    ui16_value = ((uint16_t) (MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_b_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp;
+    ui8_temp = MIDDLE_SVM_TABLE - ui8_temp;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    if (ui16_value < MIDDLE_PWM_DUTY_CYCLE_MAX)
+      ui16_phase_b_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui16_value;
+    else
+      ui16_phase_b_voltage = 0;
   }
 
   // phase C is advanced 120 degrees over phase B
-  ui8_temp = ui8_svm_table [(uint8_t) (ui8_svm_table_index + 85 /* 120º */)];
-  if (ui8_temp > MIDDLE_PWM_DUTY_CYCLE_MAX)
+  ui8_temp = ui8_svm_table [(ui16_svm_table_index + 341 /* 120º */) & SVM_TABLE_MASK];
+  if (ui8_temp > MIDDLE_SVM_TABLE)
   {
-    ui16_value = ((uint16_t) (ui8_temp - MIDDLE_PWM_DUTY_CYCLE_MAX)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_c_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui8_temp;
+    ui8_temp -= MIDDLE_SVM_TABLE;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    ui16_phase_c_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX + ui16_value;
   }
   else
   {
-    ui16_value = ((uint16_t) (MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp)) * ui8_g_duty_cycle;
-    ui8_temp = (uint8_t) (ui16_value >> 8);
-    ui8_phase_c_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui8_temp;
+    ui8_temp = MIDDLE_SVM_TABLE - ui8_temp;
+    ui16_value = (((uint16_t) ui8_temp) * ui8_duty_cycle_low) >> 8;
+    ui16_value += ((uint16_t) ui8_temp) * ui8_duty_cycle_high;
+    ui8_temp_next = ui8_temp >> 2; // dead time compensation
+    if (ui8_temp_next > ui8_dead_time_compensation_max)
+      ui8_temp_next = ui8_dead_time_compensation_max;
+    ui16_value += ui8_temp_next;
+    if (ui16_value < MIDDLE_PWM_DUTY_CYCLE_MAX)
+      ui16_phase_c_voltage = MIDDLE_PWM_DUTY_CYCLE_MAX - ui16_value;
+    else
+      ui16_phase_c_voltage = 0;
   }
 
   // set final duty_cycle value
   // phase B
-  TIM1->CCR3H = (uint8_t) (ui8_phase_b_voltage >> 7);
-  TIM1->CCR3L = (uint8_t) (ui8_phase_b_voltage << 1);
+  TIM1->CCR3H = (uint8_t) (ui16_phase_b_voltage >> 8);
+  TIM1->CCR3L = (uint8_t) ui16_phase_b_voltage;
   // phase C
-  TIM1->CCR2H = (uint8_t) (ui8_phase_c_voltage >> 7);
-  TIM1->CCR2L = (uint8_t) (ui8_phase_c_voltage << 1);
+  TIM1->CCR2H = (uint8_t) (ui16_phase_c_voltage >> 8);
+  TIM1->CCR2L = (uint8_t) ui16_phase_c_voltage;
   // phase A
-  TIM1->CCR1H = (uint8_t) (ui8_phase_a_voltage >> 7);
-  TIM1->CCR1L = (uint8_t) (ui8_phase_a_voltage << 1);
+  TIM1->CCR1H = (uint8_t) (ui16_phase_a_voltage >> 8);
+  TIM1->CCR1L = (uint8_t) ui16_phase_a_voltage;
 
   /****************************************************************************/
   // ramp up ADC battery current
@@ -1051,7 +2495,7 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
 
     // if the main loop counteris not reset that it is blocked, so, reset the system
     ++ui16_main_loop_wdt_cnt_1;
-    if (ui16_main_loop_wdt_cnt_1 > 19061) // 1 second
+    if (ui16_main_loop_wdt_cnt_1 > ((uint16_t) PWM_CYCLES_SECOND)) // 1 second
     {
       // reset system
       //  resets a STM8 microcontroller.
@@ -1062,6 +2506,22 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
   }
   /****************************************************************************/
 
+#ifdef PWM_ISR_TIME_MEASURE
+  // TIMER1 counts from the OC4 compare (counting down at PWM_ADC_SAMPLE) to here. Reading the counter high byte
+  // latches the low byte
+  ui8_temp = TIM1->CNTRH;
+  ui16_temp = (((uint16_t) ui8_temp) << 8) | TIM1->CNTRL;
+  if ((TIM1->CR1 & TIM1_CR1_DIR) == 0) // counting up
+    ui16_temp = PWM_ADC_SAMPLE + ui16_temp;
+  else if (ui16_temp <= PWM_ADC_SAMPLE) // counting down, on the same PWM cycle
+    ui16_temp = PWM_ADC_SAMPLE - ui16_temp;
+  else // counting down, on the next PWM cycle: the interrupt took longer than the PWM cycle
+    ui16_temp = PWM_ADC_SAMPLE + (2 * PWM_COUNTER_MAX) - ui16_temp;
+
+  if (ui16_temp > ui16_g_pwm_isr_time_max)
+    ui16_g_pwm_isr_time_max = ui16_temp;
+#endif
+
   // clears the TIM1 interrupt TIM1_IT_UPDATE pending bit
   TIM1->SR1 = (uint8_t)(~(uint8_t)TIM1_IT_CC4);
 }
@@ -1085,20 +2545,24 @@ void hall_sensor_init(void)
 
 void motor_init(void)
 {
-  motor_set_pwm_duty_cycle_ramp_up_inverse_step(PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP); // each step = 64us
-  motor_set_pwm_duty_cycle_ramp_down_inverse_step(PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP); // each step = 64us
+  motor_set_pwm_duty_cycle_ramp_up_inverse_step(PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP); // each step = 1 PWM cycle
+  motor_set_pwm_duty_cycle_ramp_down_inverse_step(PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP); // each step = 1 PWM cycle
 }
 
 void motor_set_pwm_duty_cycle_target(uint8_t ui8_value)
 {
-  if (ui8_value > PWM_DUTY_CYCLE_MAX)
-    ui8_value = PWM_DUTY_CYCLE_MAX;
+  uint16_t ui16_value;
+
+  // target is 8 bits, duty_cycle is 9 bits
+  ui16_value = ((uint16_t) ui8_value) << 1;
+  if (ui16_value > PWM_DUTY_CYCLE_MAX)
+    ui16_value = PWM_DUTY_CYCLE_MAX;
 
   // if brake is active, keep duty_cycle target at 0
   if (ui8_g_brake_is_set)
-    ui8_value = 0;
+    ui16_value = 0;
 
-  ui8_m_duty_cycle_target = ui8_value;
+  ui16_m_duty_cycle_target = ui16_value;
 }
 
 void motor_set_pwm_duty_cycle_ramp_up_inverse_step(uint16_t ui16_value)
@@ -1116,20 +2580,52 @@ uint16_t ui16_motor_get_motor_speed_erps(void)
   return ui16_motor_speed_erps;
 }
 
+void read_adc_oversampling(void)
+{
+  uint32_t ui32_voltage;
+  uint32_t ui32_current;
+  uint32_t ui32_offset;
+  uint16_t ui16_samples;
+
+  disableInterrupts();
+  ui32_voltage = ui32_m_adc_battery_voltage_accumulated;
+  ui32_m_adc_battery_voltage_accumulated = 0;
+  ui32_current = ui32_m_battery_charge_accumulated;
+  ui32_m_battery_charge_accumulated = 0;
+  ui16_samples = ui16_m_adc_samples;
+  ui16_m_adc_samples = 0;
+  enableInterrupts();
+
+  // calc_battery_totals() takes the charge. The samples include the ADC current offset, remove it from the charge
+  ui32_offset = ((uint32_t) ui16_g_adc_current_offset) * ui16_samples;
+  if (ui32_current > ui32_offset)
+    ui32_m_battery_charge += ui32_current - ui32_offset;
+
+  // average of the samples (about 76 at 4ms): the ADC noise dithers the samples, so the average has more resolution than
+  // the 10 bits samples. It is also the average current, while a single sample can be from any time of the current ripple
+  if (ui16_samples)
+  {
+    ui16_m_adc_battery_voltage_x8 = (uint16_t) (((ui32_voltage << 3) + (ui16_samples >> 1)) / ui16_samples);
+    ui16_m_adc_battery_current_x8 = (uint16_t) (((ui32_current << 3) + (ui16_samples >> 1)) / ui16_samples);
+  }
+}
+
 void read_battery_voltage(void)
 {
   // low pass filter the voltage readed value, to avoid possible fast spikes/noise
   ui16_adc_battery_voltage_accumulated -= ui16_adc_battery_voltage_accumulated >> READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT;
-  ui16_adc_battery_voltage_accumulated += UI16_ADC_10_BIT_BATTERY_VOLTAGE;
-  ui16_adc_battery_voltage_filtered_10b = ui16_adc_battery_voltage_accumulated >> READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT;
+  ui16_adc_battery_voltage_accumulated += ui16_m_adc_battery_voltage_x8;
+  ui16_adc_battery_voltage_filtered_x8 = ui16_adc_battery_voltage_accumulated >> READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT;
+  ui16_adc_battery_voltage_filtered_10b = (ui16_adc_battery_voltage_filtered_x8 + 4) >> 3;
 }
 
 void read_battery_current(void)
 {
   // low pass filter the positive battery readed value (no regen current), to avoid possible fast spikes/noise
   ui16_adc_battery_current_accumulated -= ui16_adc_battery_current_accumulated >> READ_BATTERY_CURRENT_FILTER_COEFFICIENT;
-  ui16_adc_battery_current_accumulated += ui16_g_adc_battery_current;
-  ui16_g_adc_battery_current_filtered = ui16_adc_battery_current_accumulated >> READ_BATTERY_CURRENT_FILTER_COEFFICIENT;
+  ui16_adc_battery_current_accumulated += ui16_m_adc_battery_current_x8;
+  ui16_g_adc_battery_current_filtered_x8 = ui16_adc_battery_current_accumulated >> READ_BATTERY_CURRENT_FILTER_COEFFICIENT;
+  ui16_g_adc_battery_current_filtered = (ui16_g_adc_battery_current_filtered_x8 + 4) >> 3;
 }
 
 void read_motor_current(void)
@@ -1150,6 +2646,7 @@ void calc_foc_angle(void)
   uint32_t ui32_l_x1048576;
   uint32_t ui32_w_angular_velocity_x16;
   uint16_t ui16_iwl_128;
+  uint8_t ui8_duty_cycle = (uint8_t) (ui16_g_duty_cycle >> 1); // 8 bits duty_cycle
 
   struct_config_vars *p_configuration_variables;
   p_configuration_variables = get_configuration_variables();
@@ -1162,15 +2659,15 @@ void calc_foc_angle(void)
   // angle between phase current and rotor magnetic flux (BEMF) is kept at 0 (max torque per amp)
 
   // calc E phase voltage
-  ui16_temp = ui16_adc_battery_voltage_filtered_10b * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512;
-  ui16_temp = (ui16_temp >> 8) * ui8_g_duty_cycle;
+  ui16_temp = (uint16_t) ((((uint32_t) ui16_adc_battery_voltage_filtered_x8) * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512) >> 11);
+  ui16_temp = ui16_temp * ui8_duty_cycle;
   ui16_e_phase_voltage = ui16_temp >> 9;
 
   // calc I phase current
-  if (ui8_g_duty_cycle > 10)
+  if (ui8_duty_cycle > 10)
   {
-    ui16_temp = ((uint16_t) ui16_g_adc_battery_current_filtered) * ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512;
-    ui32_i_phase_current_x2 = ui16_temp / ui8_g_duty_cycle;
+    ui32_temp = ((uint32_t) ui16_g_adc_battery_current_filtered_x8) * ADC10BITS_BATTERY_CURRENT_PER_ADC_STEP_X512;
+    ui32_i_phase_current_x2 = ui32_temp / (((uint16_t) ui8_duty_cycle) << 3);
   }
   else
   {
@@ -1217,6 +2714,213 @@ void calc_foc_angle(void)
   ui8_g_foc_angle = (uint8_t) (ui16_foc_angle_accumulated >> 4);
 }
 
+void calc_bemf_observer(void)
+{
+  uint8_t ui8_temp;
+  uint16_t ui16_bemf_x8;
+  uint16_t ui16_erps;
+  uint32_t ui32_temp;
+
+  // Sensorless fallback for a broken hall sensor signal. Motor speed is proportional to the BEMF, the constant (erps per volt)
+  // is learned while the hall sensors are good and used after a fault to estimate the motor speed and so the rotor angle
+  // increment on each PWM cycle. The valid hall sensors edges that still exist resync the rotor angle.
+
+  // calc BEMF: phase voltage * cos(FOC angle), as the I*w*L voltage is 90 degrees from the BEMF
+  // phase resistance voltage drop is not considered, it is similar when learning and when estimating
+  ui16_bemf_x8 = ui16_adc_battery_voltage_filtered_10b * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512;
+  ui16_bemf_x8 = ((ui16_bemf_x8 >> 8) * ((uint8_t) (ui16_g_duty_cycle >> 1))) >> 6;
+  ui8_temp = 64 /* 90º */ - ui8_g_foc_angle;
+  if (ui8_temp < SIN_TABLE_LEN)
+  {
+    ui16_bemf_x8 = (ui16_bemf_x8 * ui8_sin_table[ui8_temp]) >> 7;
+  }
+
+  if (ui8_m_observer_enabled == 0)
+  {
+    ui16_erps = ui16_motor_speed_erps;
+
+    // learn the motor BEMF constant (the motor model does not include overmodulation and field weakening)
+    if ((ui8_g_hall_sensors_fault == 0) &&
+        (ui8_g_overmodulation == 0) &&
+        (ui8_g_field_weakening_angle == 0) &&
+        (ui8_motor_commutation_type == SINEWAVE_INTERPOLATION_60_DEGREES) &&
+        (ui16_erps >= MOTOR_OBSERVER_MIN_ERPS) &&
+        ui16_bemf_x8)
+    {
+      ui32_temp = (((uint32_t) ui16_erps) << 11) / ui16_bemf_x8;
+      if (ui32_temp > 0xffff)
+        ui32_temp = 0xffff;
+
+      ui32_m_observer_erps_per_volt_accumulated -= (ui32_m_observer_erps_per_volt_accumulated >> 4);
+      ui32_m_observer_erps_per_volt_accumulated += ui32_temp;
+      ui16_m_observer_erps_per_volt_x256 = (uint16_t) (ui32_m_observer_erps_per_volt_accumulated >> 4);
+    }
+  }
+  else
+  {
+    // estimate the motor speed from the BEMF
+    ui16_erps = (uint16_t) ((((uint32_t) ui16_m_observer_erps_per_volt_x256) * ui16_bemf_x8) >> 11);
+
+    if (ui16_erps < MOTOR_OBSERVER_MIN_ERPS)
+    {
+      // BEMF is too low to estimate the rotor angle, go back to the hall sensors
+      ui8_m_observer_enabled = 0;
+    }
+    else
+    {
+      ui16_motor_speed_erps = ui16_erps;
+      // keep the value for the interpolation, when going back to the hall sensors
+      ui16_PWM_cycles_counter_total = ((uint16_t) PWM_CYCLES_SECOND) / ui16_erps;
+    }
+  }
+
+  // rotor angle increment on each PWM cycle: 256 angle units each electrical rotation, x256
+  ui16_m_observer_angle_step_x256 = (uint16_t) ((((uint32_t) ui16_erps) << 16) / PWM_CYCLES_SECOND);
+}
+
+void calc_field_weakening(void)
+{
+  uint16_t ui16_bemf_x8;
+  uint16_t ui16_max_voltage_x8;
+  uint8_t ui8_target;
+
+  // Field weakening angle feed-forward from the voltage margin: the BEMF at the motor speed (BEMF constant learned
+  // by calc_bemf_observer()) against the max phase voltage (max duty_cycle and overmodulation). When BEMF is higher,
+  // the voltage vector is advanced so the d-axis current reduces the rotor flux by the missing voltage:
+  // sin(angle) = (BEMF - max voltage) / BEMF. The PWM cycle interrupt moves the angle fast up to this target,
+  // keeps increasing it slower while the voltage is saturated and reduces it if motor current is over the max.
+  // The target is 0 at steady state up to the max voltage speed, so the voltage saturation must start the field
+  // weakening; the target only recovers the angle fast after a current limit or a speed transient.
+  if ((ui8_g_field_weakening_enable_state == 0) ||
+      (ui16_m_observer_erps_per_volt_x256 == 0)) // no motor model yet, the voltage saturation only drives the angle
+  {
+    ui8_target = 0;
+  }
+  else
+  {
+    ui16_bemf_x8 = (uint16_t) ((((uint32_t) ui16_motor_speed_erps) << 11) / ui16_m_observer_erps_per_volt_x256);
+
+    // same phase voltage calculation as calc_bemf_observer(), at max duty_cycle, plus 10% of overmodulation
+    ui16_max_voltage_x8 = ui16_adc_battery_voltage_filtered_10b * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512;
+    ui16_max_voltage_x8 = ((ui16_max_voltage_x8 >> 8) * ((uint8_t) (PWM_DUTY_CYCLE_MAX >> 1))) >> 6;
+    ui16_max_voltage_x8 += ui16_max_voltage_x8 / 10;
+
+    if (ui16_bemf_x8 <= ui16_max_voltage_x8)
+    {
+      ui8_target = 0;
+    }
+    else
+    {
+      ui8_target = asin_table((uint8_t) ((((uint32_t) (ui16_bemf_x8 - ui16_max_voltage_x8)) << 7) / ui16_bemf_x8));
+      if (ui8_target > FIELD_WEAKENING_ANGLE_MAX)
+        ui8_target = FIELD_WEAKENING_ANGLE_MAX;
+    }
+  }
+
+  ui8_m_field_weakening_angle_target = ui8_target;
+}
+
+void calc_battery_totals(void)
+{
+  uint32_t ui32_charge;
+
+  // The battery current is summed on every PWM cycle, so the totals have no aliasing of the current samples and no
+  // truncation of the filtered current. The fractions are kept for the next time.
+  ui32_charge = ui32_m_battery_charge;
+  ui32_m_battery_charge = 0;
+
+  ui32_m_battery_charge_mah_fraction += ui32_charge;
+  while (ui32_m_battery_charge_mah_fraction >= BATTERY_CHARGE_PER_MAH)
+  {
+    ui32_m_battery_charge_mah_fraction -= BATTERY_CHARGE_PER_MAH;
+    ++ui32_g_battery_charge_mah;
+  }
+
+  // energy = charge * voltage, >> 8 to keep it on 32 bits
+  ui32_m_battery_energy_wh_x10_fraction += ((ui32_charge >> 8) * ui16_adc_battery_voltage_filtered_x8) +
+                                           (((ui32_charge & 0xff) * ui16_adc_battery_voltage_filtered_x8) >> 8);
+  while (ui32_m_battery_energy_wh_x10_fraction >= BATTERY_ENERGY_PER_WH_X10)
+  {
+    ui32_m_battery_energy_wh_x10_fraction -= BATTERY_ENERGY_PER_WH_X10;
+    ++ui32_g_battery_energy_wh_x10;
+  }
+}
+
+void calc_battery_resistance(void)
+{
+  uint16_t ui16_voltage = ui16_adc_battery_voltage_filtered_x8;
+  uint16_t ui16_current = ui16_g_adc_battery_current_filtered_x8;
+  uint16_t ui16_delta_voltage = 0;
+  uint16_t ui16_delta_current;
+  uint16_t ui16_resistance;
+  uint32_t ui32_temp;
+  uint8_t ui8_voltage;
+
+  // a current step from the reference point measures the resistance, as the open circuit voltage did not change
+  // meanwhile: the voltage must go down when the current goes up, and up when the current goes down
+  if (ui16_current > ui16_m_battery_resistance_current)
+  {
+    ui16_delta_current = ui16_current - ui16_m_battery_resistance_current;
+    if (ui16_m_battery_resistance_voltage_x8 > ui16_voltage)
+      ui16_delta_voltage = ui16_m_battery_resistance_voltage_x8 - ui16_voltage;
+  }
+  else
+  {
+    ui16_delta_current = ui16_m_battery_resistance_current - ui16_current;
+    if (ui16_voltage > ui16_m_battery_resistance_voltage_x8)
+      ui16_delta_voltage = ui16_voltage - ui16_m_battery_resistance_voltage_x8;
+  }
+
+  if (ui16_delta_current >= (BATTERY_RESISTANCE_CURRENT_STEP_MIN << 3))
+  {
+    if ((ui16_delta_voltage > 0) && (ui16_delta_voltage < (256 << 3)))
+    {
+      ui16_resistance = (uint16_t) ((((uint32_t) ui16_delta_voltage) << 8) / ui16_delta_current);
+      if (ui16_resistance <= BATTERY_RESISTANCE_X256_MAX)
+      {
+        // low pass filter, each step has an error of a fraction of the ADC step of the voltage
+        if (ui16_m_battery_resistance_x256 == 0)
+          ui16_m_battery_resistance_accumulated_x256 = ui16_resistance << 3;
+        else
+        {
+          ui16_m_battery_resistance_accumulated_x256 -= ui16_m_battery_resistance_accumulated_x256 >> 3;
+          ui16_m_battery_resistance_accumulated_x256 += ui16_resistance;
+        }
+        ui16_m_battery_resistance_x256 = ui16_m_battery_resistance_accumulated_x256 >> 3;
+      }
+    }
+
+    ui8_m_battery_resistance_counter = BATTERY_RESISTANCE_REFERENCE_CYCLES;
+  }
+  else
+  {
+    ++ui8_m_battery_resistance_counter;
+  }
+
+  // new reference point after a step, or after some time so the open circuit voltage and the slow battery
+  // voltage recovery do not change between the reference and a step
+  if (ui8_m_battery_resistance_counter >= BATTERY_RESISTANCE_REFERENCE_CYCLES)
+  {
+    ui8_m_battery_resistance_counter = 0;
+    ui16_m_battery_resistance_voltage_x8 = ui16_voltage;
+    ui16_m_battery_resistance_current = ui16_current;
+  }
+
+  // open circuit voltage = loaded voltage + resistance * current
+  ui32_temp = ui16_voltage + ((((uint32_t) ui16_m_battery_resistance_x256) * ui16_current) >> 8);
+  if (ui32_temp > (1023 << 3))
+    ui32_temp = 1023 << 3;
+  ui16_m_battery_voltage_ocv_x8 = (uint16_t) ui32_temp;
+
+  // the cut off is on the open circuit voltage, so the voltage sag of a current peak does not cut the motor.
+  // 1 ADC step of hysteresis, as the open circuit voltage goes up again after the cut off
+  ui8_voltage = (uint8_t) (ui16_m_battery_voltage_ocv_x8 >> 5);
+  if (ui8_voltage < ui8_adc_battery_voltage_cut_off)
+    ui8_m_battery_voltage_low = 1;
+  else if (ui8_voltage > ui8_adc_battery_voltage_cut_off)
+    ui8_m_battery_voltage_low = 0;
+}
+
 // calc asin also converts the final result to degrees
 uint8_t asin_table (uint8_t ui8_inverted_angle_x128)
 {
@@ -1239,6 +2943,24 @@ uint8_t asin_table (uint8_t ui8_inverted_angle_x128)
 void motor_set_adc_battery_voltage_cut_off(uint8_t ui8_value)
 {
   ui8_adc_battery_voltage_cut_off = ui8_value;
+
+  // the PWM interrupt also cuts on the loaded voltage, at 1/8 under the cut off, in case the current limit did
+  // not keep the loaded voltage over the cut off
+  ui8_m_adc_battery_voltage_cut_off_min = ui8_value - (ui8_value >> 3);
+}
+
+uint16_t motor_get_adc_battery_current_max_cut_off(void)
+{
+  uint16_t ui16_cut_off_x8 = ((uint16_t) ui8_adc_battery_voltage_cut_off) << 5;
+
+  // the current that keeps the loaded voltage, open circuit voltage - resistance * current, at the cut off.
+  // Voltage is x8, so << 5 instead of << 8 for the ADC 10 bits current
+  if (ui16_m_battery_resistance_x256 == 0)
+    return 0xffff;
+  else if (ui16_m_battery_voltage_ocv_x8 <= ui16_cut_off_x8)
+    return 0;
+  else
+    return (uint16_t) ((((uint32_t) (ui16_m_battery_voltage_ocv_x8 - ui16_cut_off_x8)) << 5) / ui16_m_battery_resistance_x256);
 }
 
 uint16_t motor_get_adc_battery_voltage_filtered_10b(void)
@@ -1246,73 +2968,86 @@ uint16_t motor_get_adc_battery_voltage_filtered_10b(void)
   return ui16_adc_battery_voltage_filtered_10b;
 }
 
+uint16_t motor_get_adc_battery_voltage_filtered_x8(void)
+{
+  return ui16_adc_battery_voltage_filtered_x8;
+}
+
+uint16_t motor_get_adc_torque_sensor_x4(void)
+{
+  uint32_t ui32_torque_sensor;
+  uint16_t ui16_samples;
+
+  disableInterrupts();
+  ui32_torque_sensor = ui32_m_adc_torque_sensor_accumulated;
+  ui32_m_adc_torque_sensor_accumulated = 0;
+  ui16_samples = ui16_m_adc_torque_sensor_samples;
+  ui16_m_adc_torque_sensor_samples = 0;
+  enableInterrupts();
+
+  // average of the samples in phase with the excitation since the last call (about 119 at 50ms), with 2 more bits (x4).
+  // No samples if PWM_COUNTER_MAX never samples the phase: use the last sample
+  if (ui16_samples)
+    return (uint16_t) (((ui32_torque_sensor << 2) + (ui16_samples >> 1)) / ui16_samples);
+  else
+    return UI16_ADC_10_BIT_TORQUE_SENSOR << 2;
+}
+
 void motor_enable_pwm(void)
 {
-  TIM1_OC1Init(TIM1_OCMODE_PWM1,
-#ifdef DISABLE_PWM_CHANNELS_1_3
-         TIM1_OUTPUTSTATE_DISABLE,
-         TIM1_OUTPUTNSTATE_DISABLE,
-#else
-         TIM1_OUTPUTSTATE_ENABLE,
-         TIM1_OUTPUTNSTATE_ENABLE,
-#endif
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
-
-  TIM1_OC2Init(TIM1_OCMODE_PWM1,
-         TIM1_OUTPUTSTATE_ENABLE,
-         TIM1_OUTPUTNSTATE_ENABLE,
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
-
-  TIM1_OC3Init(TIM1_OCMODE_PWM1,
-#ifdef DISABLE_PWM_CHANNELS_1_3
-         TIM1_OUTPUTSTATE_DISABLE,
-         TIM1_OUTPUTNSTATE_DISABLE,
-#else
-         TIM1_OUTPUTSTATE_ENABLE,
-         TIM1_OUTPUTNSTATE_ENABLE,
-#endif
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
+  // the ISR keeps the phases at 50% duty_cycle (0 volts between phases) while duty_cycle is 0, so only the outputs enable bits are needed
+  // outputs enable bits are preloaded and applied at the same time to the 3 phases, by the COM event
+  TIM1->CCER1 = TIM1_CCER1_PWM_ENABLED;
+  TIM1->CCER2 = TIM1_CCER2_PWM_ENABLED;
+  TIM1->OISR = TIM1_OISR_PWM;
+  TIM1->EGR = TIM1_EGR_COMG;
 }
 
 void motor_disable_pwm(void)
 {
-  TIM1_OC1Init(TIM1_OCMODE_PWM1,
-         TIM1_OUTPUTSTATE_DISABLE,
-         TIM1_OUTPUTNSTATE_DISABLE,
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
-
-  TIM1_OC2Init(TIM1_OCMODE_PWM1,
-         TIM1_OUTPUTSTATE_DISABLE,
-         TIM1_OUTPUTNSTATE_DISABLE,
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
-
-  TIM1_OC3Init(TIM1_OCMODE_PWM1,
-         TIM1_OUTPUTSTATE_DISABLE,
-         TIM1_OUTPUTNSTATE_DISABLE,
-         255, // initial duty_cycle value
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCPOLARITY_HIGH,
-         TIM1_OCIDLESTATE_RESET,
-         TIM1_OCIDLESTATE_SET);
+  TIM1->CCER1 = TIM1_CCER1_PWM_DISABLED;
+  TIM1->CCER2 = TIM1_CCER2_PWM_DISABLED;
+  TIM1->OISR = TIM1_OISR_PWM;
+  TIM1->EGR = TIM1_EGR_COMG;
+}
+
+// Enable PWM also on a spinning motor (flying start): the duty_cycle starts at the value that applies the motor BEMF
+// voltage, so there is no current spike. Returns 0 and keeps PWM disabled if the motor is spinning and the BEMF constant
+// is not yet learned, then the motor needs to stop first.
+uint8_t motor_enable_pwm_flying_start(void)
+{
+  uint16_t ui16_bemf_x8;
+  uint16_t ui16_temp;
+  uint32_t ui32_temp;
+
+  if (ui16_motor_speed_erps == 0)
+  {
+    ui32_temp = 0;
+  }
+  else if (ui16_m_observer_erps_per_volt_x256 == 0)
+  {
+    return 0;
+  }
+  else
+  {
+    // inverse of the BEMF calculation of calc_bemf_observer(), with FOC angle 0
+    ui16_bemf_x8 = (uint16_t) ((((uint32_t) ui16_motor_speed_erps) << 11) / ui16_m_observer_erps_per_volt_x256);
+    ui16_temp = (ui16_adc_battery_voltage_filtered_10b * ADC10BITS_BATTERY_VOLTAGE_PER_ADC_STEP_X512) >> 8;
+    if (ui16_temp == 0)
+      return 0;
+
+    ui32_temp = ((((uint32_t) ui16_bemf_x8) << 6) / ui16_temp) << 1;
+    if (ui32_temp > PWM_DUTY_CYCLE_MAX)
+      ui32_temp = PWM_DUTY_CYCLE_MAX;
+  }
+
+  // the PWM interrupt ramps these values, and a 16 bits write is not atomic
+  disableInterrupts();
+  ui16_g_duty_cycle = (uint16_t) ui32_temp;
+  ui8_g_overmodulation = 0;
+  ui8_g_field_weakening_angle = 0;
+  enableInterrupts();
+  motor_enable_pwm();
 
+  return 1;
 }
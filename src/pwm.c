@@ -28,8 +28,8 @@ void pwm_init_bipolar_4q (void)
 
   TIM1_TimeBaseInit(0, // TIM1_Prescaler = 0
         TIM1_COUNTERMODE_CENTERALIGNED1,
-        (421 - 1), // clock = 16MHz; counter period = 842; PWM freq = 16MHz / 842 = 19kHz;
-        //(BUT PWM center aligned mode needs twice the frequency)
+        PWM_COUNTER_MAX, // clock = 16MHz; center aligned mode counts up and down, counter period = 2 * PWM_COUNTER_MAX;
+        // PWM freq = 16MHz / (2 * 420) = 19kHz
         1); // will fire the TIM1_IT_UPDATE at every PWM period cycle
 
   TIM1_OC1Init(TIM1_OCMODE_PWM1,
@@ -73,7 +73,7 @@ void pwm_init_bipolar_4q (void)
   // OC4 is always syncronized with PWM
   TIM1_OC4Init(TIM1_OCMODE_PWM1,
          TIM1_OUTPUTSTATE_DISABLE,
-         285, // timming for interrupt firing (hand adjusted)
+         PWM_ADC_SAMPLE, // timming for interrupt firing (hand adjusted)
          TIM1_OCPOLARITY_HIGH,
          TIM1_OCIDLESTATE_RESET);
 
@@ -81,11 +81,15 @@ void pwm_init_bipolar_4q (void)
   TIM1_BDTRConfig(TIM1_OSSISTATE_ENABLE,
       TIM1_LOCKLEVEL_OFF,
       // hardware nees a dead time of 1us
-      16, // DTG = 0; dead time in 62.5 ns steps; 1us/62.5ns = 16
+      PWM_DEAD_TIME, // DTG = 0; dead time in 62.5 ns steps; 1us/62.5ns = 16
       TIM1_BREAK_DISABLE,
       TIM1_BREAKPOLARITY_LOW,
       TIM1_AUTOMATICOUTPUT_DISABLE);
 
+  // from now on, outputs enable bits are preloaded and only applied on COM event,
+  // so motor_enable_pwm() and motor_disable_pwm() switch the 3 phases at the same time
+  TIM1_CCPreloadControl(ENABLE);
+
   TIM1_ITConfig(TIM1_IT_CC4, ENABLE);
   TIM1_Cmd(ENABLE); // TIM1 counter enable
   TIM1_CtrlPWMOutputs(ENABLE);
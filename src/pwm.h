@@ -9,6 +9,36 @@
 #ifndef _PWM_H
 #define _PWM_H
 
+#include "main.h"
+
+// TIM1 registers image of the PWM outputs enabled and disabled states, as configured by pwm_init_bipolar_4q():
+// PWM1 mode and high polarity on the 3 phases (CC1, CC2, CC3) and complementary outputs, CC4 output disabled
+#ifdef DISABLE_PWM_CHANNELS_1_3
+#define TIM1_CCER1_PWM_ENABLED    (TIM1_CCER1_CC2E | TIM1_CCER1_CC2NE)
+#define TIM1_CCER2_PWM_ENABLED    0
+#else
+#define TIM1_CCER1_PWM_ENABLED    (TIM1_CCER1_CC1E | TIM1_CCER1_CC1NE | TIM1_CCER1_CC2E | TIM1_CCER1_CC2NE)
+#define TIM1_CCER2_PWM_ENABLED    (TIM1_CCER2_CC3E | TIM1_CCER2_CC3NE)
+#endif
+#define TIM1_CCER1_PWM_DISABLED   0
+#define TIM1_CCER2_PWM_DISABLED   0
+#define TIM1_OISR_PWM             0 // all outputs low (MOSFETs off) on idle state
+
+// hardware needs a dead time of 1us, in 62.5 ns steps: 1us / 62.5ns = 16
+#define PWM_DEAD_TIME                 16
+// dead time compensation on each phase value (TIM1 counts), half of the dead time as the counter counts up and down
+#define PWM_DEAD_TIME_COMPENSATION    (PWM_DEAD_TIME >> 1)
+// max FOC angle for the dead time compensation, as it follows the phase voltage: 4 = 5.6 degrees
+#define PWM_DEAD_TIME_COMPENSATION_FOC_ANGLE_MAX    4
+
+// TIM1 counts up and down between 0 and PWM_COUNTER_MAX (center aligned mode 1, PWM_COUNTER_MAX is on config.h)
+// and the OC4 interrupt fires when counting down
+// TIM1 counts from OC4 interrupt to the ADC sample: OC4 at 285 was hand adjusted to sample at the middle of
+// phases values when that middle value was 254
+#define PWM_ADC_SAMPLE_LATENCY        31
+// OC4 value for the ADC sample, at the middle of the phases values
+#define PWM_ADC_SAMPLE                (MIDDLE_PWM_DUTY_CYCLE_MAX + PWM_ADC_SAMPLE_LATENCY)
+
 void pwm_init_bipolar_4q (void);
 
 #endif /* _PWM_H_ */
@@ -0,0 +1,206 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware
+ *
+ * Host check of the assist current from the pedal power: compares the firmware Q24 multipliers
+ * (update_derived_parameters() and calc_assist_adc_current() of ebike_app.c) with the previous version, that used
+ * two 32 bits divisions: (power_x10 * assist_level_factor_x1000 / 1000) * 51 / 80 for assist and
+ * (power_x10 * boost_assist_level / 100) * 51 / 80 for boost, truncated to 16 bits and limited to the motor max current.
+ * The firmware functions are copied, only with a stand-in for m_config_vars: update them here when the firmware ones
+ * change.
+ *
+ * Sweep: every motor max current from ebike_app_set_motor_max_current() (0 - 255 amps setting, limited to
+ * ADC_MOTOR_CURRENT_MAX), every factor 0 - 65535 and every pedal power x10 from 0 up to where both versions are at the
+ * motor max current (the previous version only increases from there, until its 16 bits truncation wraps, where the
+ * firmware version keeps the motor max current).
+ *
+ * Released under the GPL License, Version 3
+ *
+ * Usage (from the repository root):
+ *   gcc -O2 -Wall -o assist_current_check tools/assist_current_check.c && ./assist_current_check
+ *
+ * The exit code is 1 when any result differs by more than 1 ADC current step.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ADC_MOTOR_CURRENT_MAX 255 // the max main.h allows, config.h has 192
+#define POWER_X10_MAX 65535
+#define FACTOR_MAX 65535
+
+typedef struct _configuration_variables
+{
+  uint16_t ui16_assist_level_factor_x1000;
+  uint16_t ui16_startup_motor_power_boost_assist_level;
+} struct_configuration_variables;
+
+static struct_configuration_variables m_config_vars;
+static uint16_t ui16_m_adc_motor_current_max;
+
+static uint16_t ui16_m_derived_assist_level_factor_x1000 = 0;
+static uint16_t ui16_m_derived_boost_assist_level = 0;
+static uint16_t ui16_m_derived_adc_motor_current_max = 0;
+static uint32_t ui32_m_assist_level_factor_q24 = 0;
+static uint32_t ui32_m_assist_power_x10_max = 0xffffffff;
+static uint32_t ui32_m_boost_assist_level_q24 = 0;
+static uint32_t ui32_m_boost_power_x10_max = 0xffffffff;
+static uint32_t calc_assist_power_x10_max(uint32_t ui32_factor_q24);
+
+static void ui16_limit_max(uint16_t *ui16_p_value, uint16_t ui16_max_value)
+{
+  if (*ui16_p_value > ui16_max_value) { *ui16_p_value = ui16_max_value; }
+}
+
+// firmware version, ebike_app.c
+static void update_derived_parameters(void)
+{
+  if ((ui16_m_derived_assist_level_factor_x1000 == m_config_vars.ui16_assist_level_factor_x1000) &&
+      (ui16_m_derived_boost_assist_level == m_config_vars.ui16_startup_motor_power_boost_assist_level) &&
+      (ui16_m_derived_adc_motor_current_max == ui16_m_adc_motor_current_max))
+    return;
+
+  ui16_m_derived_assist_level_factor_x1000 = m_config_vars.ui16_assist_level_factor_x1000;
+  ui16_m_derived_boost_assist_level = m_config_vars.ui16_startup_motor_power_boost_assist_level;
+  ui16_m_derived_adc_motor_current_max = ui16_m_adc_motor_current_max;
+
+  // current = (power_x10 * assist_level_factor_x1000 / 1000) * 51 / 80
+  // 6.410 = 1 / 0.156 (each ADC step for current)
+  // 6.410 * 8 = ~51
+  // 51 * 2^24 / 80000 = 10695 + 297 / 625, rounded. Q24 and not Q16: the Q16 rounding error of small factors adds up
+  // to 2 ADC steps over the range
+  ui32_m_assist_level_factor_q24 = (((uint32_t) ui16_m_derived_assist_level_factor_x1000) * 10695) +
+                                   (((((uint32_t) ui16_m_derived_assist_level_factor_x1000) * 297) + 312) / 625);
+  // same for boost, that is x100: 51 * 2^24 / 8000 = 106954 + 94 / 125. Over 40000 it does not fit 32 bits, and any
+  // pedal power gives over the motor max current (ADC_MOTOR_CURRENT_MAX is up to 255)
+  if (ui16_m_derived_boost_assist_level > 40000)
+    ui32_m_boost_assist_level_q24 = 0xffffffff;
+  else
+    ui32_m_boost_assist_level_q24 = (((uint32_t) ui16_m_derived_boost_assist_level) * 106954) +
+                                    (((((uint32_t) ui16_m_derived_boost_assist_level) * 94) + 62) / 125);
+
+  // over these values the current is limited to the motor max current, and the Q24 multiplication does not overflow
+  // (under them, power_x10 * multiplier < motor max current << 24)
+  ui32_m_assist_power_x10_max = 0xffffffff;
+  if (ui32_m_assist_level_factor_q24)
+    ui32_m_assist_power_x10_max = calc_assist_power_x10_max(ui32_m_assist_level_factor_q24);
+
+  ui32_m_boost_power_x10_max = 0xffffffff;
+  if (ui32_m_boost_assist_level_q24)
+    ui32_m_boost_power_x10_max = calc_assist_power_x10_max(ui32_m_boost_assist_level_q24);
+}
+
+// firmware version, ebike_app.c
+// the min pedal power x10 with the current at the motor max current: (motor max current << 24) / multiplier, rounded up
+static uint32_t calc_assist_power_x10_max(uint32_t ui32_factor_q24)
+{
+  if (ui16_m_derived_adc_motor_current_max == 0)
+    return 0;
+
+  return (((((uint32_t) ui16_m_derived_adc_motor_current_max) << 24) - 1) / ui32_factor_q24) + 1;
+}
+
+// firmware version, ebike_app.c
+static uint16_t calc_assist_adc_current(uint32_t ui32_power_x10, uint32_t ui32_factor_q24, uint32_t ui32_power_x10_max)
+{
+  if (ui32_power_x10 >= ui32_power_x10_max)
+    return ui16_m_adc_motor_current_max;
+  else
+    return (uint16_t) ((ui32_power_x10 * ui32_factor_q24) >> 24);
+}
+
+// previous firmware version, divisor 1000 for assist and 100 for boost
+static uint16_t calc_assist_adc_current_division(uint32_t ui32_power_x10, uint32_t ui32_factor, uint32_t ui32_divisor)
+{
+  uint32_t ui32_current_amps_x10;
+  uint16_t ui16_adc_current;
+
+  ui32_current_amps_x10 = (ui32_power_x10 * ui32_factor) / ui32_divisor;
+
+  // 6.410 = 1 / 0.156 (each ADC step for current)
+  // 6.410 * 8 = ~51
+  ui16_adc_current = (uint16_t) ((ui32_current_amps_x10 * 51) / 80);
+  ui16_limit_max(&ui16_adc_current, ui16_m_adc_motor_current_max);
+
+  return ui16_adc_current;
+}
+
+int main(void)
+{
+  uint16_t ui16_amps;
+  uint16_t ui16_current_max_last = 0xffff;
+  uint32_t ui32_factor;
+  uint32_t ui32_power_x10;
+  uint8_t ui8_boost;
+  uint16_t ui16_current;
+  uint16_t ui16_current_division;
+  uint16_t ui16_difference;
+  uint32_t ui32_cases[2] = { 0, 0 };
+  uint32_t ui32_off_by_1[2] = { 0, 0 };
+  uint32_t ui32_differences = 0;
+  uint16_t ui16_difference_max = 0;
+
+  for (ui16_amps = 0; ui16_amps < 256; ui16_amps++)
+  {
+    // ebike_app_set_motor_max_current()
+    ui16_m_adc_motor_current_max = (uint16_t) ((ui16_amps << 8) / 40);
+    if (ui16_m_adc_motor_current_max > ADC_MOTOR_CURRENT_MAX)
+      ui16_m_adc_motor_current_max = ADC_MOTOR_CURRENT_MAX;
+
+    if (ui16_m_adc_motor_current_max == ui16_current_max_last)
+      continue;
+    ui16_current_max_last = ui16_m_adc_motor_current_max;
+
+    for (ui32_factor = 0; ui32_factor <= FACTOR_MAX; ui32_factor++)
+    {
+      m_config_vars.ui16_assist_level_factor_x1000 = (uint16_t) ui32_factor;
+      m_config_vars.ui16_startup_motor_power_boost_assist_level = (uint16_t) ui32_factor;
+      update_derived_parameters();
+
+      for (ui8_boost = 0; ui8_boost < 2; ui8_boost++)
+      {
+        for (ui32_power_x10 = 0; ui32_power_x10 <= POWER_X10_MAX; ui32_power_x10++)
+        {
+          if (ui8_boost)
+          {
+            ui16_current = calc_assist_adc_current(ui32_power_x10, ui32_m_boost_assist_level_q24, ui32_m_boost_power_x10_max);
+            ui16_current_division = calc_assist_adc_current_division(ui32_power_x10, ui32_factor, 100);
+          }
+          else
+          {
+            ui16_current = calc_assist_adc_current(ui32_power_x10, ui32_m_assist_level_factor_q24, ui32_m_assist_power_x10_max);
+            ui16_current_division = calc_assist_adc_current_division(ui32_power_x10, ui32_factor, 1000);
+          }
+          ++ui32_cases[ui8_boost];
+
+          ui16_difference = (ui16_current > ui16_current_division) ? (ui16_current - ui16_current_division) :
+                                                                      (ui16_current_division - ui16_current);
+          if (ui16_difference > ui16_difference_max)
+            ui16_difference_max = ui16_difference;
+
+          if (ui16_difference == 1)
+          {
+            ++ui32_off_by_1[ui8_boost];
+          }
+          else if (ui16_difference > 1)
+          {
+            if (ui32_differences < 10)
+              printf("%s, motor max current %u, factor %u, power x10 %u: %u, previous %u\n",
+                     ui8_boost ? "boost" : "assist", ui16_m_adc_motor_current_max, ui32_factor, ui32_power_x10,
+                     ui16_current, ui16_current_division);
+            ++ui32_differences;
+          }
+
+          // both at the motor max current, also for all the higher pedal power
+          if ((ui16_current == ui16_m_adc_motor_current_max) &&
+              (ui16_current_division == ui16_m_adc_motor_current_max))
+            break;
+        }
+      }
+    }
+  }
+
+  printf("assist: %u cases, %u off by 1\n", ui32_cases[0], ui32_off_by_1[0]);
+  printf("boost: %u cases, %u off by 1\n", ui32_cases[1], ui32_off_by_1[1]);
+  printf("max difference %u ADC steps, %u cases over 1\n", ui16_difference_max, ui32_differences);
+  return ui32_differences ? 1 : 0;
+}
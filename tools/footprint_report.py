@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+#
+# TongSheng TSDZ2 motor controller firmware
+#
+# Flash/RAM footprint report built from the SDCC linker map (.map) and
+# relocated listings (.rst), with a configurable budget check.
+#
+# Released under the GPL License, Version 3
+#
+# Usage (from src/, after make -f Makefile_linux):
+#   python3 ../tools/footprint_report.py main.map --rst-dir . --rst-dir STM8S_StdPeriph_Lib/src \
+#     --flash-budget 32768 --ram-budget 1792 [--module-budget motor=8000] [-o main_footprint.json]
+#
+# The linker only writes .rst listings for the .rel files given on its command line,
+# not for the modules pulled from a library: for those use --lst-dir with the
+# directory of their assembler listings (.lst), e.g. --lst-dir stdperiph_split.
+#
+# The JSON report goes to stdout (or to the -o file) and the exit code is 1
+# when any budget is exceeded, so size regressions break the build.
+
+import argparse
+import glob
+import json
+import os
+import re
+import sys
+
+# STM8S105 memory map
+RAM_END = 0x0800
+FLASH_START = 0x8000
+FLASH_END = 0x10000
+
+RE_AREA_HEADER = re.compile(r'^Area\s+Addr\s+Size')
+RE_AREA = re.compile(r'^\.?\s*(\S+)\s+([0-9A-Fa-f]+)\s+([0-9A-Fa-f]+)\s+=\s+(\d+)\.\s+bytes')
+RE_SYMBOL = re.compile(r'^\s+([0-9A-Fa-f]+)\s+(\S+)\s+(\S+)\s*$')
+
+RE_RST_AREA = re.compile(r'^\s.*\d+\s+\.area\s+(\S+)')
+RE_RST_LABEL = re.compile(r'^\s+([0-9A-Fa-f]{6})\s+\d+\s+(_[A-Za-z0-9_]+)::?\s*$')
+RE_RST_BYTES = re.compile(r'^\s+([0-9A-Fa-f]{6})((?:\s[0-9A-Fa-f]{2}(?:r|s)?)+)\s')
+RE_RST_DS = re.compile(r'^\s+([0-9A-Fa-f]{6})\s+\d+\s+\.ds\s+(\d+)')
+
+# symbols that we always want to see on the report
+WATCHED_SYMBOLS = ['_ui8_svm_table', '_ui8_sin_table', '_ui16_duty_cycle_inverse_x65536']
+
+# memory of the not relocated .lst listings areas
+AREA_MEMORY = {'CODE': 'flash', 'CONST': 'flash', 'INITIALIZER': 'flash', 'HOME': 'flash',
+               'GSINIT': 'flash', 'GSFINAL': 'flash', 'DATA': 'ram', 'INITIALIZED': 'ram'}
+
+RE_FLOAT_LIB = re.compile(r'^_?_?(fs|u?long2fs|s?long2fs|u?int2fs|s?int2fs|u?char2fs|s?char2fs|log|exp|sqrt|pow|sin|cos|tan|atan|fabs|frexp|ldexp|modf|floor|ceil)')
+
+
+def memory_of(address):
+    if address < RAM_END:
+        return 'ram'
+    if FLASH_START <= address < FLASH_END:
+        return 'flash'
+    return None
+
+
+def parse_map(path):
+    """Return the list of areas and the list of global symbols of the map file."""
+    areas = []
+    symbols = []
+    area = None
+    expect_area = False
+
+    with open(path, errors='replace') as f:
+        for line in f:
+            if RE_AREA_HEADER.match(line):
+                expect_area = True
+                continue
+
+            if expect_area:
+                m = RE_AREA.match(line)
+                if m:
+                    area = {'name': m.group(1),
+                            'address': int(m.group(2), 16),
+                            'size': int(m.group(4))}
+                    areas.append(area)
+                    expect_area = False
+                continue
+
+            if area is None:
+                continue
+
+            m = RE_SYMBOL.match(line)
+            if m and not m.group(1).startswith('-'):
+                try:
+                    value = int(m.group(1), 16)
+                except ValueError:
+                    continue
+                symbols.append({'name': m.group(2),
+                                'module': m.group(3),
+                                'address': value,
+                                'area': area['name']})
+
+    return areas, symbols
+
+
+def symbol_sizes_from_map(areas, symbols):
+    """Size of each global symbol is the distance to the next symbol on the same area."""
+    area_end = {a['name']: a['address'] + a['size'] for a in areas}
+    area_start = {a['name']: a['address'] for a in areas}
+    by_area = {}
+    for s in symbols:
+        by_area.setdefault(s['area'], []).append(s)
+
+    for name, syms in by_area.items():
+        syms.sort(key=lambda s: s['address'])
+        for i, s in enumerate(syms):
+            end = syms[i + 1]['address'] if i + 1 < len(syms) else area_end.get(name, s['address'])
+            s['size'] = max(0, end - s['address'])
+
+    unattributed = {}
+    for name, syms in by_area.items():
+        if syms and name in area_start:
+            gap = syms[0]['address'] - area_start[name]
+            if gap > 0:
+                unattributed[name] = gap
+
+    return unattributed
+
+
+def parse_rst(path, relocated=True):
+    """Return the symbols (functions and variables) of a relocated (.rst) or not relocated (.lst)
+    listing, with sizes. The .lst addresses start at 0 on each area, the memory comes from the area name."""
+    module = os.path.splitext(os.path.basename(path))[0]
+    area = None
+    labels = []
+    area_end = {}
+
+    with open(path, errors='replace') as f:
+        for line in f:
+            m = RE_RST_AREA.match(line)
+            if m:
+                area = m.group(1)
+                continue
+
+            m = RE_RST_LABEL.match(line)
+            if m:
+                labels.append({'name': m.group(2),
+                               'module': module,
+                               'address': int(m.group(1), 16),
+                               'area': area})
+                continue
+
+            m = RE_RST_DS.match(line)
+            if m:
+                end = int(m.group(1), 16) + int(m.group(2))
+                area_end[area] = max(area_end.get(area, 0), end)
+                continue
+
+            m = RE_RST_BYTES.match(line)
+            if m:
+                end = int(m.group(1), 16) + len(m.group(2).split())
+                area_end[area] = max(area_end.get(area, 0), end)
+
+    by_area = {}
+    for s in labels:
+        by_area.setdefault(s['area'], []).append(s)
+
+    for name, syms in by_area.items():
+        syms.sort(key=lambda s: s['address'])
+        for i, s in enumerate(syms):
+            end = syms[i + 1]['address'] if i + 1 < len(syms) else area_end.get(name, s['address'])
+            s['size'] = max(0, end - s['address'])
+            s['memory'] = memory_of(s['address']) if relocated else AREA_MEMORY.get(name)
+
+    return labels
+
+
+def module_group(module, firmware_modules):
+    if module.startswith('stm8s_'):
+        return 'stdperiph'
+    if RE_FLOAT_LIB.match(module):
+        return 'float_lib'
+    if module in firmware_modules:
+        return 'firmware'
+    return 'runtime_lib'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='SDCC flash/RAM footprint report')
+    parser.add_argument('map', help='linker map file, e.g. main.map')
+    parser.add_argument('--rst-dir', action='append', default=[],
+                        help='directory with the .rst relocated listings (can be repeated)')
+    parser.add_argument('--lst-dir', action='append', default=[],
+                        help='directory with the .lst listings of library modules (can be repeated)')
+    parser.add_argument('--flash-budget', type=int, default=0, help='max flash bytes, 0 to disable')
+    parser.add_argument('--ram-budget', type=int, default=0, help='max RAM bytes (without stack), 0 to disable')
+    parser.add_argument('--module-budget', action='append', default=[],
+                        help='max flash bytes of a module, as module=bytes (can be repeated)')
+    parser.add_argument('-o', '--output', help='write the JSON report to this file instead of stdout')
+    args = parser.parse_args()
+
+    areas, symbols = parse_map(args.map)
+    if not areas:
+        sys.stderr.write('footprint: no areas found on %s\n' % args.map)
+        return 2
+
+    unattributed = symbol_sizes_from_map(areas, symbols)
+
+    # prefer the .rst listings, they also have the static functions and variables
+    rst_symbols = []
+    firmware_modules = set()
+    for d in args.rst_dir:
+        for path in sorted(glob.glob(os.path.join(d, '*.rst'))):
+            rst_symbols.extend(parse_rst(path))
+            module = os.path.splitext(os.path.basename(path))[0]
+            if os.path.exists(os.path.join(d, module + '.c')) and not module.startswith('stm8s_'):
+                firmware_modules.add(module)
+    rst_modules = set(s['module'] for s in rst_symbols)
+
+    # library modules listings, only of the modules that were linked
+    linked_modules = set(s['module'] for s in symbols)
+    for d in args.lst_dir:
+        for path in sorted(glob.glob(os.path.join(d, '*.lst'))):
+            module = os.path.splitext(os.path.basename(path))[0]
+            if module in linked_modules and module not in rst_modules:
+                rst_symbols.extend(parse_rst(path, relocated=False))
+    rst_modules = set(s['module'] for s in rst_symbols)
+
+    if (args.rst_dir or args.lst_dir) and not rst_symbols:
+        sys.stderr.write('footprint: no symbols found on the .rst/.lst listings, the report only has the map globals\n')
+
+    entries = [s for s in symbols if s['module'] not in rst_modules] + rst_symbols
+
+    report = {'flash': {'total': 0, 'areas': {}},
+              'ram': {'total': 0, 'areas': {}, 'stack': 0},
+              'groups': {},
+              'modules': {},
+              'watched_symbols': {},
+              'unattributed': unattributed}
+
+    for a in areas:
+        memory = memory_of(a['address'])
+        if memory is None or a['size'] == 0:
+            continue
+        if a['name'] == 'SSEG':
+            report['ram']['stack'] = a['size']
+            continue
+        report[memory]['areas'][a['name']] = a['size']
+        report[memory]['total'] += a['size']
+
+    for s in entries:
+        memory = s['memory'] if 'memory' in s else memory_of(s['address'])
+        if memory is None or s['area'] == 'SSEG':
+            continue
+        module = report['modules'].setdefault(s['module'], {'flash': 0, 'ram': 0, 'symbols': {}})
+        module[memory] += s['size']
+        module['symbols'][s['name'].lstrip('_')] = {'area': s['area'], 'memory': memory, 'size': s['size']}
+
+        group = report['groups'].setdefault(module_group(s['module'], firmware_modules), {'flash': 0, 'ram': 0})
+        group[memory] += s['size']
+
+        if s['name'] in WATCHED_SYMBOLS:
+            report['watched_symbols'][s['name'].lstrip('_')] = s['size']
+
+    # check budgets
+    errors = []
+    if args.flash_budget and report['flash']['total'] > args.flash_budget:
+        errors.append('flash %d > budget %d' % (report['flash']['total'], args.flash_budget))
+    if args.ram_budget and report['ram']['total'] > args.ram_budget:
+        errors.append('RAM %d > budget %d' % (report['ram']['total'], args.ram_budget))
+    for item in args.module_budget:
+        name, _, value = item.partition('=')
+        size = report['modules'].get(name, {}).get('flash', 0)
+        if size > int(value):
+            errors.append('module %s flash %d > budget %s' % (name, size, value))
+
+    report['budget'] = {'flash': args.flash_budget,
+                        'ram': args.ram_budget,
+                        'ok': not errors,
+                        'errors': errors}
+
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+
+    sys.stderr.write('footprint: flash %d bytes, RAM %d bytes (+ %d stack)\n' %
+                     (report['flash']['total'], report['ram']['total'], report['ram']['stack']))
+    for e in errors:
+        sys.stderr.write('footprint: BUDGET EXCEEDED: %s\n' % e)
+
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
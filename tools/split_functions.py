@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# TongSheng TSDZ2 motor controller firmware
+#
+# Splits STM8S StdPeriph driver sources in one source file per function, so
+# they can be compiled and archived as a library: the SDCC linker only pulls
+# from a library the modules (now single functions) that are referenced,
+# while a linked .rel always brings all the functions of the driver.
+#
+# Released under the GPL License, Version 3
+#
+# Usage:
+#   python3 ../tools/split_functions.py -o stdperiph_split STM8S_StdPeriph_Lib/src/stm8s_tim1.c ...
+
+import argparse
+import os
+import re
+import sys
+
+RE_FUNCTION_NAME = re.compile(r'(\w+)\s*\(')
+RE_GLOBAL_DEFINITION = re.compile(r'^(?!static\b|typedef\b|extern\b)([A-Za-z_][\w\s\*]*?)\s+(\w+)\s*(\[[^\]]*\])?\s*=.*;\s*(/\*.*\*/)?\s*$')
+
+
+def split_source(path):
+    """Return (preamble, static functions, public functions) of a StdPeriph driver source.
+
+    StdPeriph code style is used to find the functions: the body opens with a
+    '{' line and closes with a '}' line, both on column 0, and the signature
+    lines are right before the '{' line, after the doxygen comment.
+    """
+    with open(path, errors='replace') as f:
+        lines = f.read().split('\n')
+
+    functions = []
+    i = 0
+    while i < len(lines):
+        if lines[i].rstrip() == '{':
+            start = i
+            while start > 0:
+                previous = lines[start - 1].strip()
+                if previous == '' or previous.endswith('*/') or previous == '}' or previous.startswith('#'):
+                    break
+                start -= 1
+
+            end = i
+            while end < len(lines) and lines[end].rstrip() != '}':
+                end += 1
+
+            signature = ' '.join(l.strip() for l in lines[start:i])
+            # functions that can be executed from RAM are declared as IN_RAM(signature)
+            signature = re.sub(r'^IN_RAM\s*\(', '', signature)
+            m = RE_FUNCTION_NAME.search(signature)
+            if m is None:
+                sys.stderr.write('split_functions: %s:%d: no function name found\n' % (path, i + 1))
+                sys.exit(1)
+
+            functions.append({'name': m.group(1),
+                              'static': signature.startswith('static'),
+                              'first_line': start,
+                              'text': '\n'.join(lines[start:end + 1]) + '\n'})
+            i = end + 1
+            continue
+        i += 1
+
+    if not functions:
+        return None, [], []
+
+    preamble_lines = lines[:functions[0]['first_line']]
+
+    # global variables are defined once, on the data file, and declared as extern on the other files
+    data = '\n'.join(preamble_lines) + '\n'
+    declarations = []
+    has_globals = False
+    for line in preamble_lines:
+        m = RE_GLOBAL_DEFINITION.match(line)
+        if m:
+            declarations.append('extern %s %s%s;' % (m.group(1), m.group(2), '[]' if m.group(3) else ''))
+            has_globals = True
+        else:
+            declarations.append(line)
+    preamble = '\n'.join(declarations) + '\n'
+
+    statics = [f for f in functions if f['static']]
+    public = [f for f in functions if not f['static']]
+
+    return (preamble, data if has_globals else None), statics, public
+
+
+def main():
+    parser = argparse.ArgumentParser(description='split StdPeriph sources in one file per function')
+    parser.add_argument('-o', '--output-dir', required=True)
+    parser.add_argument('sources', nargs='+')
+    args = parser.parse_args()
+
+    os.makedirs(args.output_dir, exist_ok=True)
+
+    for path in args.sources:
+        module = os.path.splitext(os.path.basename(path))[0]
+        preambles, statics, public = split_source(path)
+        if preambles is None:
+            continue
+        preamble, data = preambles
+
+        if data is not None:
+            with open(os.path.join(args.output_dir, '%s__data.c' % module), 'w') as f:
+                f.write(data)
+
+        for function in public:
+            # static helpers are private to the driver source, so copy them to each function that uses them
+            used_statics = [s['text'] for s in statics
+                            if re.search(r'\b%s\s*\(' % s['name'], function['text'])]
+
+            with open(os.path.join(args.output_dir, '%s__%s.c' % (module, function['name'])), 'w') as f:
+                f.write(preamble)
+                for text in used_statics:
+                    f.write('\n' + text)
+                f.write('\n' + function['text'])
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
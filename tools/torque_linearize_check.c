@@ -0,0 +1,296 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware
+ *
+ * Host check of the torque sensor linearization: compares the firmware lookup with the precomputed interval weights
+ * (calc_torque_sensor_linearize_intervals() and linearize_torque_sensor_to_kgs() of ebike_app.c) with the previous
+ * version, that summed the steps of every interval on each call. Both functions are copied from the firmware, only
+ * renamed: update them here when the firmware ones change.
+ *
+ * Random calibration tables (increasing and unordered points, small and full range interval steps, all zeros) and
+ * random ADC offsets, with every ADC step value 0 - 1023 for the left and right pedal and a pedal flag not 0 or 1.
+ * All the arithmetic is stored on uint16_t / uint32_t variables with explicit casts, so the host int size does not
+ * change the results from the SDCC ones.
+ *
+ * Released under the GPL License, Version 3
+ *
+ * Usage (from the repository root):
+ *   gcc -O2 -Wall -o torque_linearize_check tools/torque_linearize_check.c && ./torque_linearize_check [tables]
+ *
+ * The exit code is 1 when any result is different.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TORQUE_SENSOR_LINEARIZE_NR_POINTS 8
+#define TS_ADC_VALUE           0
+#define TS_ADC_INTERVAL_STEPS  1
+
+#define TABLES_DEFAULT 4000
+#define ADC_STEPS_MAX 1024
+
+uint16_t ui16_torque_sensor_linearize_right[TORQUE_SENSOR_LINEARIZE_NR_POINTS][2];
+uint16_t ui16_torque_sensor_linearize_left[TORQUE_SENSOR_LINEARIZE_NR_POINTS][2];
+static uint16_t ui16_m_torque_sensor_linearize_start[2]; // left, right
+static uint32_t ui32_m_torque_sensor_linearize_weight[2][TORQUE_SENSOR_LINEARIZE_NR_POINTS];
+volatile uint16_t ui16_g_adc_torque_sensor_min_value;
+
+static uint32_t ui32_m_random = 0x2545f491;
+
+static uint16_t random_16(void)
+{
+  // xorshift32
+  ui32_m_random ^= ui32_m_random << 13;
+  ui32_m_random ^= ui32_m_random >> 17;
+  ui32_m_random ^= ui32_m_random << 5;
+  return (uint16_t) (ui32_m_random >> 8);
+}
+
+// previous firmware version, before the precomputed intervals
+static void linearize_torque_sensor_to_kgs_sum(uint16_t *ui16_adc_steps, uint16_t *ui16_weight_x10, uint8_t *ui8_pedal_right)
+{
+  uint16_t ui16_array_sum[TORQUE_SENSOR_LINEARIZE_NR_POINTS];
+  uint8_t ui8_i;
+  uint16_t ui16_adc_absolute;
+  uint16_t (*ui16_array_linear)[2];
+  uint32_t ui32_temp = 0;
+  uint16_t _ui16_adc_steps = *ui16_adc_steps;
+  uint8_t _ui8_pedal_right = *ui8_pedal_right;
+
+  memset(ui16_array_sum, 0, sizeof(ui16_array_sum));
+
+  if (_ui8_pedal_right)
+    ui16_array_linear = ui16_torque_sensor_linearize_right;
+  else
+    ui16_array_linear = ui16_torque_sensor_linearize_left;
+
+  if (_ui16_adc_steps > 0)
+  {
+    ui16_adc_absolute = _ui16_adc_steps + ui16_g_adc_torque_sensor_min_value;
+
+    for (ui8_i = 0; ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1); ui8_i++)
+    {
+      // value is under interval max value
+      if (ui16_adc_absolute < ui16_array_linear[ui8_i + 1][TS_ADC_VALUE])
+      {
+        // first
+        if (ui8_i == 0)
+        {
+          ui16_array_sum[ui8_i] = _ui16_adc_steps;
+        }
+        else
+        {
+          ui16_array_sum[ui8_i] = ui16_adc_absolute - ui16_array_linear[ui8_i][TS_ADC_VALUE];
+        }
+
+        // exit the for loop as this was the last interval
+        break;
+      }
+      // current value is over current interval
+      else
+      {
+        ui16_array_sum[ui8_i] = ui16_array_linear[ui8_i + 1][TS_ADC_VALUE] - ui16_array_linear[ui8_i][TS_ADC_VALUE];
+      }
+    }
+
+    // count values under min value of array linear
+    if (ui16_g_adc_torque_sensor_min_value < ui16_array_linear[0][TS_ADC_VALUE])
+      ui16_array_sum[0] += (ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value);
+
+    // count with the values over max value of array linear
+    if (ui16_adc_absolute > ui16_array_linear[7][TS_ADC_VALUE])
+      ui16_array_sum[7] = ui16_adc_absolute - ui16_array_linear[7][TS_ADC_VALUE];
+
+    // sum the total parcels
+    for (ui8_i = 0; ui8_i < TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1; ui8_i++)
+    {
+      ui32_temp += ((uint32_t) ui16_array_sum[ui8_i] * (uint32_t) ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS]);
+    }
+
+    // sum the last parcel
+    ui32_temp += ((uint32_t) ui16_array_sum[7] * (uint32_t) ui16_array_linear[7][TS_ADC_INTERVAL_STEPS]);
+
+    *ui16_weight_x10 = (uint16_t) (ui32_temp / 10);
+  }
+  // no torque_sensor_adc_steps
+  else
+  {
+    *ui16_weight_x10 = 0;
+  }
+}
+
+// firmware version, ebike_app.c
+static void linearize_torque_sensor_to_kgs(uint16_t *ui16_adc_steps, uint16_t *ui16_weight_x10, uint8_t *ui8_pedal_right)
+{
+  uint8_t ui8_i;
+  uint8_t ui8_pedal = *ui8_pedal_right ? 1 : 0;
+  uint16_t ui16_adc_absolute;
+  uint16_t (*ui16_array_linear)[2];
+  uint32_t ui32_temp;
+
+  if (*ui16_adc_steps > 0)
+  {
+    if (ui8_pedal)
+      ui16_array_linear = ui16_torque_sensor_linearize_right;
+    else
+      ui16_array_linear = ui16_torque_sensor_linearize_left;
+
+    ui16_adc_absolute = *ui16_adc_steps + ui16_g_adc_torque_sensor_min_value;
+
+    // the interval of the value is the first one with the next point over the value, or the last one
+    for (ui8_i = 0; ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1); ui8_i++)
+    {
+      if (ui16_adc_absolute < ui16_array_linear[ui8_i + 1][TS_ADC_VALUE])
+        break;
+    }
+
+    // weight of the full intervals before, plus the part of this interval
+    ui32_temp = ui32_m_torque_sensor_linearize_weight[ui8_pedal][ui8_i];
+    if (ui8_i == 0)
+    {
+      ui32_temp += ((uint32_t) ((uint16_t) (ui16_adc_absolute - ui16_m_torque_sensor_linearize_start[ui8_pedal]))) *
+                   ui16_array_linear[1][TS_ADC_INTERVAL_STEPS];
+    }
+    else if (ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1))
+    {
+      ui32_temp += ((uint32_t) ((uint16_t) (ui16_adc_absolute - ui16_array_linear[ui8_i][TS_ADC_VALUE]))) *
+                   ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS];
+    }
+
+    // count with the values over max value of array linear (also on a previous interval, if the points are not in order)
+    if (ui16_adc_absolute > ui16_array_linear[7][TS_ADC_VALUE])
+      ui32_temp += ((uint32_t) (ui16_adc_absolute - ui16_array_linear[7][TS_ADC_VALUE])) * ui16_array_linear[7][TS_ADC_INTERVAL_STEPS];
+
+    *ui16_weight_x10 = (uint16_t) (ui32_temp / 10);
+  }
+  // no torque_sensor_adc_steps
+  else
+  {
+    *ui16_weight_x10 = 0;
+  }
+}
+
+// firmware version, ebike_app.c
+static void calc_torque_sensor_linearize_intervals(void)
+{
+  uint8_t ui8_i;
+  uint8_t ui8_pedal;
+  uint16_t ui16_steps;
+  uint16_t (*ui16_array_linear)[2];
+  uint32_t ui32_temp;
+
+  for (ui8_pedal = 0; ui8_pedal < 2; ui8_pedal++)
+  {
+    if (ui8_pedal)
+      ui16_array_linear = ui16_torque_sensor_linearize_right;
+    else
+      ui16_array_linear = ui16_torque_sensor_linearize_left;
+
+    // the first interval starts at the ADC offset and the values under min value of array linear are counted on it
+    // (on the ADC steps of the value, from the offset, and once more from the offset to the first point)
+    ui16_m_torque_sensor_linearize_start[ui8_pedal] = ui16_g_adc_torque_sensor_min_value;
+    ui16_steps = ui16_array_linear[1][TS_ADC_VALUE] - ui16_array_linear[0][TS_ADC_VALUE];
+    if (ui16_g_adc_torque_sensor_min_value < ui16_array_linear[0][TS_ADC_VALUE])
+    {
+      ui16_m_torque_sensor_linearize_start[ui8_pedal] -= ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value;
+      ui16_steps += ui16_array_linear[0][TS_ADC_VALUE] - ui16_g_adc_torque_sensor_min_value;
+    }
+
+    ui32_temp = 0;
+    for (ui8_i = 0; ui8_i < (TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1); ui8_i++)
+    {
+      ui32_m_torque_sensor_linearize_weight[ui8_pedal][ui8_i] = ui32_temp;
+
+      if (ui8_i > 0)
+        ui16_steps = ui16_array_linear[ui8_i + 1][TS_ADC_VALUE] - ui16_array_linear[ui8_i][TS_ADC_VALUE];
+
+      ui32_temp += ((uint32_t) ui16_steps) * ui16_array_linear[ui8_i + 1][TS_ADC_INTERVAL_STEPS];
+    }
+    ui32_m_torque_sensor_linearize_weight[ui8_pedal][TORQUE_SENSOR_LINEARIZE_NR_POINTS - 1] = ui32_temp;
+  }
+}
+
+static void random_table(uint16_t (*ui16_array_linear)[2], uint8_t ui8_type)
+{
+  uint8_t ui8_i;
+  uint16_t ui16_value = random_16() % 400;
+
+  for (ui8_i = 0; ui8_i < TORQUE_SENSOR_LINEARIZE_NR_POINTS; ui8_i++)
+  {
+    switch (ui8_type)
+    {
+      case 0: // increasing points, small interval steps (real calibration tables)
+      ui16_array_linear[ui8_i][TS_ADC_VALUE] = ui16_value;
+      ui16_array_linear[ui8_i][TS_ADC_INTERVAL_STEPS] = random_16() % 64;
+      ui16_value += random_16() % 100;
+      break;
+
+      case 1: // increasing points, full range interval steps
+      ui16_array_linear[ui8_i][TS_ADC_VALUE] = ui16_value;
+      ui16_array_linear[ui8_i][TS_ADC_INTERVAL_STEPS] = random_16();
+      ui16_value += random_16() % 100;
+      break;
+
+      case 2: // unordered points over the ADC range
+      ui16_array_linear[ui8_i][TS_ADC_VALUE] = random_16() % 1200;
+      ui16_array_linear[ui8_i][TS_ADC_INTERVAL_STEPS] = random_16();
+      break;
+
+      default: // all zeros, no calibration received
+      ui16_array_linear[ui8_i][TS_ADC_VALUE] = 0;
+      ui16_array_linear[ui8_i][TS_ADC_INTERVAL_STEPS] = 0;
+      break;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  static const uint8_t ui8_pedal_flags[] = { 0, 1, 2 };
+  uint32_t ui32_tables = TABLES_DEFAULT;
+  uint32_t ui32_table;
+  uint32_t ui32_cases = 0;
+  uint32_t ui32_differences = 0;
+  uint16_t ui16_adc_steps;
+  uint16_t ui16_weight_sum_x10;
+  uint16_t ui16_weight_x10;
+  uint8_t ui8_pedal_right;
+  uint8_t ui8_i;
+
+  if (argc > 1)
+    ui32_tables = strtoul(argv[1], NULL, 0);
+
+  for (ui32_table = 0; ui32_table < ui32_tables; ui32_table++)
+  {
+    random_table(ui16_torque_sensor_linearize_left, (uint8_t) (ui32_table & 3));
+    random_table(ui16_torque_sensor_linearize_right, (uint8_t) ((ui32_table >> 2) & 3));
+    ui16_g_adc_torque_sensor_min_value = random_16() % 512;
+
+    calc_torque_sensor_linearize_intervals();
+
+    for (ui8_i = 0; ui8_i < sizeof(ui8_pedal_flags); ui8_i++)
+    {
+      for (ui16_adc_steps = 0; ui16_adc_steps < ADC_STEPS_MAX; ui16_adc_steps++)
+      {
+        ui8_pedal_right = ui8_pedal_flags[ui8_i];
+        linearize_torque_sensor_to_kgs_sum(&ui16_adc_steps, &ui16_weight_sum_x10, &ui8_pedal_right);
+        linearize_torque_sensor_to_kgs(&ui16_adc_steps, &ui16_weight_x10, &ui8_pedal_right);
+        ++ui32_cases;
+
+        if (ui16_weight_x10 != ui16_weight_sum_x10)
+        {
+          if (ui32_differences < 10)
+            printf("table %u, offset %u, pedal %u, ADC steps %u: %u, previous %u\n", ui32_table,
+                   ui16_g_adc_torque_sensor_min_value, ui8_pedal_right, ui16_adc_steps, ui16_weight_x10,
+                   ui16_weight_sum_x10);
+          ++ui32_differences;
+        }
+      }
+    }
+  }
+
+  printf("%u cases, %u differences\n", ui32_cases, ui32_differences);
+  return ui32_differences ? 1 : 0;
+}